@@ -0,0 +1,94 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for checking a DMA control block program and working out its keying timeline without running it
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_CBVERIFIER_H_
+#define INCLUDE_CBVERIFIER_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <unordered_set>
+#include <vector>
+#include "../include/GPIO.h"
+#include "../include/Logger.h"
+#include "../include/PCMHW.h"
+
+// The verifier follows a control block chain the way the DMA engine would, reading the control blocks from host
+// memory.  Writes the program makes to DMA memory (a glyph link setting a fragment's next control block) are kept
+// in an overlay, so the program itself is not changed.  Time is counted in words written to the PCM FIFO: the first
+// PCM_FIFO_SIZE fill the FIFO, and each one after that waits for one PCM clock.
+class CBVerifier {
+ public:
+  typedef struct Edge {
+    uint32_t pin;
+    bool keyDown;
+    uint64_t tick;  // PCM clocks from the start of the channel
+  } Edge;
+
+  typedef struct Result {
+    bool valid;          // no errors found
+    bool terminated;     // reached a control block with no next control block
+    bool loops;          // came back to the start of the program - the numbers are for one cycle
+    uint64_t ticks;      // PCM clocks from the start until the program ends, or of one cycle
+    uint64_t keyDownTicks;
+    uint64_t executed;   // control blocks executed
+    uint64_t distinct;   // control blocks used
+    uint64_t fifoWords;  // words written to the PCM FIFO
+    uint32_t registerWrites;  // peripheral writes other than the FIFO and the key
+    uint32_t errors;
+    std::vector<Edge> edges;
+  } Result;
+
+ private:
+  typedef struct Region {
+    uint32_t busAddr;
+    uint8_t * virtualAddr;
+    size_t size;
+  } Region;
+
+  std::vector<Region> regions;
+  std::vector<uint32_t> pins;
+  std::map<uint32_t, uint32_t> overlay;  // words written by the program, by bus address
+  double tickRate;
+
+  bool inRegion(uint32_t busAddr, size_t size);
+  uint32_t readWord(uint32_t busAddr);
+  void error(Result & result, uint32_t cbAddr, const char * problem);
+
+ public:
+  static const uint64_t MAXIMUM_BLOCKS = 1ULL << 26;  // a chain that runs longer than this is taken as endless
+  void addRegion(uint32_t busAddr, void * virtualAddr, size_t size);  // DMA memory the program may use
+  void watchPin(uint32_t pin);  // a pin keyed by function select writes
+  Result verify(uint32_t firstCB, uint64_t maximumBlocks = MAXIMUM_BLOCKS);
+  void report(const Result & result);
+  explicit CBVerifier(double tickRate);
+};
+#endif  // INCLUDE_CBVERIFIER_H_
@@ -34,29 +34,38 @@ Mark Broihier 2021
 #define INCLUDE_CLOCK_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
+#include <vector>
 #include "../include/GPIO.h"
+#include "../include/Logger.h"
 #include "../include/Peripheral.h"
 
 #define CM_BASE 0x00101000
 #define CM_LEN 0x1660
 #define CLK_CTL_BUSY (1 << 7)
+#define CLK_CTL_BUSY_TIMEOUT 0.01  // seconds
 #define CLK_CTL_KILL (1 << 5)
 #define CLK_CTL_ENAB (1 << 4)
 #define CLK_CTL_SRC(x) ((x) << 0)
+#define CLK_CTL_MASH(x) ((x) << 9)
 
+#define CLK_CTL_SRC_OSC 1
 #define CLK_CTL_SRC_PLLA 4
 #define CLK_CTL_SRC_PLLC 5
 #define CLK_CTL_SRC_PLLD 6
 
 #define CLK_DIVI 5
 #define CLK_DIV_DIVI(x) ((x) << 12)
+#define CLK_DIV_DIVF(x) ((x) << 0)
 
 #define BCM_PASSWD (0x5A << 24)
 
 #define CORECLK (0x00000008 / 8)
 #define PCMCLK  (0x00000098 /8)
 #define GP0CLK  (0x00000070 / 8)
+#define GP1CLK  (0x00000078 / 8)
+#define GP2CLK  (0x00000080 / 8)
 #define CM_PLLC (0x00000108 / 8)
 #define EMMCCLK (0x000001d0 / 8)
 
@@ -72,11 +81,24 @@ Mark Broihier 2021
 #define CM_LOCK (0x00000114 /8)  // to access this with CLKCtrlReg, use the div offset
 #define CM_LOCK_FLOCKC (1 << 10)
 #define CM_LOCK_FLOCKD (1 << 11)
+#define CM_LOCK_TIMEOUT 0.1  // seconds
+#define CM_LOCK_SETTLE 20  // microseconds for a lock bit left from the old frequency to drop
 
 
 #define XOSC_FREQUENCY 19200000LL
 
 class Clock {
+ public:
+  typedef struct FrequencyPlan {
+    uint32_t frequency;       // requested
+    uint32_t divider;         // GP0 integer divider
+    uint32_t gp0Div;          // GP0 divider register word
+    uint32_t pllcFrac;        // PLLC fractional multiplier register word
+    uint32_t pllcCtrl;        // PLLC control (integer multiplier) register word
+    double actualFrequency;
+    double error;             // Hz, actual - requested
+  } FrequencyPlan;
+
  private:
   typedef struct CLKCtrlReg {
     // See https://elinux.org/BCM2835_registers#CM
@@ -88,12 +110,37 @@ class Clock {
   uint32_t centerFrequency;
   uint64_t pllcFrequency;  // frequency of PLLC
   uint64_t plldFrequency;  // frequency of PLLD
+  uint32_t gp0ControlCopy; // GP0 clock control settings before GP0 was switched to PLLC
+  FrequencyPlan plan;      // PLLC and GP0 settings for the center frequency
+  std::vector<uint32_t> outputClocks;  // GP1/GP2 clocks started by startOutput
 
   GPIO * gpio;
 
+  // startup timing - each phase runs from the end of the previous one
+  typedef struct Phase {
+    const char * name;
+    double seconds;
+  } Phase;
+  std::vector<Phase> phases;
+  struct timespec phaseStart;
+
+  void tuneClock();
+  void stopClock(uint32_t clock, const char * name);
+
  public:
   volatile CLKCtrlReg *clkReg;
   void initClock();
+  void setFrequency(uint32_t centerFrequency);
+  static FrequencyPlan planFrequency(uint32_t frequency);
+  static void reportPlan(const FrequencyPlan & plan);
+  std::vector<RegisterWrite> retuneSequence(const FrequencyPlan & plan);  // for a DMA program
+  double startOutput(GPIO * gpio, uint32_t frequency);  // runs GP1 or GP2 from PLLC, returns the actual frequency
+  // poll until (register & mask) == value - false, with a message, if that doesn't happen within timeout seconds
+  static bool waitForRegister(volatile uint32_t * reg, uint32_t mask, uint32_t value, double timeout,
+                              const char * what);
+  void endPhase(const char * name);
+  void reportPhases();
+  inline uint32_t getFrequency(){return centerFrequency;}
   inline uint64_t getPLLCFrequency(){return pllcFrequency;}
   inline uint64_t getPLLDFrequency(){return plldFrequency;}
   explicit Clock(uint32_t centerFrequency, GPIO * gpio, Peripheral * peripheralUtil);
@@ -0,0 +1,95 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for sub-allocating DMA control blocks and constants from a few large VideoCore mailbox blocks
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_DMAARENA_H_
+#define INCLUDE_DMAARENA_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include "../include/HWBackend.h"
+#include "../include/Logger.h"
+#include "../include/Peripheral.h"
+
+// https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define MEM_FLAG_DIRECT (1 << 2)
+#define MEM_FLAG_COHERENT (2 << 2)
+#define MEM_FLAG_L1_NONALLOCATING (MEM_FLAG_DIRECT | MEM_FLAG_COHERENT)
+#define BUS_TO_PHYS(x) ((x) & ~0xC0000000)
+
+// Mailbox blocks (alloc, lock and map - three round trips to the VideoCore each) are kept until the arena is
+// destroyed.  Released allocations go back to their block's free space, so a channel that sends message after
+// message stops making mailbox calls once it has reached its high water mark.
+class DMAArena {
+ public:
+  typedef struct Allocation {
+    void *virtualAddr;  // NULL when not allocated
+    uint32_t busAddr;   // this is not a pointer in user space
+    uint32_t size;
+    uint32_t block;     // index of the mailbox block it came from
+  } Allocation;
+
+ private:
+  static const uint32_t PAGE_SIZE = 4096;
+  static const uint32_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+  typedef struct Block {
+    void *virtualAddr;
+    uint32_t busAddr;
+    uint32_t mbHandle;  // Used by mailbox property interface
+    uint32_t size;
+    std::map<uint32_t, uint32_t> freeSpace;  // offset to size
+  } Block;
+
+  HWBackend * hw;
+  int mailboxFD;
+  std::vector<Block> blocks;
+  uint32_t blockSize;
+  size_t bytesInUse;
+  size_t highWater;
+  uint32_t mailboxAllocations;
+
+  uint32_t addBlock(size_t size);
+  bool allocateFromBlock(uint32_t block, uint32_t size, uint32_t align, Allocation * allocation);
+
+ public:
+  void allocate(size_t size, uint32_t align, Allocation * allocation);
+  void release(Allocation * allocation);
+  size_t getMailboxBytes();  // held from the VideoCore
+  void getFreeSpace(size_t * total, size_t * largest);
+  inline size_t getHighWater() { return highWater; }
+  inline uint32_t getMailboxAllocations() { return mailboxAllocations; }
+  explicit DMAArena(Peripheral * peripheralUtil, uint32_t blockSize = DEFAULT_BLOCK_SIZE);
+  ~DMAArena(void);
+};
+#endif  // INCLUDE_DMAARENA_H_
@@ -33,20 +33,29 @@ Mark Broihier 2021
 #ifndef INCLUDE_DMACHANNEL_H_
 #define INCLUDE_DMACHANNEL_H_
 #include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+#include "../include/CBVerifier.h"
+#include "../include/DMAArena.h"
 #include "../include/GPIO.h"
 #include "../include/mailbox.h"
+#include "../include/MorseEncoder.h"
 #include "../include/Peripheral.h"
 #include "../include/PCMHW.h"
-
-// https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
-#define MEM_FLAG_DIRECT (1 << 2)
-#define MEM_FLAG_COHERENT (2 << 2)
-#define MEM_FLAG_L1_NONALLOCATING (MEM_FLAG_DIRECT | MEM_FLAG_COHERENT)
-#define BUS_TO_PHYS(x) ((x) & ~0xC0000000)
+#include "../include/ProgramCache.h"
+#include "../include/StatsPage.h"
 
 /* DMA Base Address */
 #define DMA_BASE 0x00007000
@@ -63,10 +72,17 @@ Mark Broihier 2021
 #define DMA_WAIT_ON_WRITES (1 << 28)
 #define DMA_PANIC_PRIORITY(x) ((x) << 20)
 #define DMA_PRIORITY(x) ((x) << 16)
+#define DMA_PAUSED (1 << 4)
 #define DMA_INTERRUPT_STATUS (1 << 2)
 #define DMA_END_FLAG (1 << 1)
 #define DMA_ACTIVE (1 << 0)
 #define DMA_DISDEBUG (1 << 28)
+#define DMA_ERROR (1 << 8)
+
+/* DMA DEBUG register bits - cleared by writing 1 */
+#define DMA_DEBUG_READ_ERROR (1 << 2)
+#define DMA_DEBUG_FIFO_ERROR (1 << 1)
+#define DMA_DEBUG_READ_LAST_NOT_SET_ERROR (1 << 0)
 
 /* DMA channel min and max */
 #define DMA_CHANNEL_MINIMUM 0
@@ -75,11 +91,36 @@ Mark Broihier 2021
 #define PERI_BUS_BASE 0x7E000000
 
 class DMAChannel {
+ public:
+  typedef struct BeaconStep {
+    std::vector<RegisterWrite> retune;  // made before the message, while the key is up
+    char * subSymbols;
+    size_t subSymbolsSize;
+  } BeaconStep;
+
+  // one of several outputs keyed by the same program - gpio is the pin of a GPCLK0, GPCLK1 or GPCLK2 output
+  typedef struct Output {
+    GPIO * gpio;
+    char * subSymbols;
+    size_t subSymbolsSize;
+  } Output;
+
+  // Supplies subsymbols to a streaming channel.  It must not block: it returns the number of subsymbols placed in
+  // the buffer, 0 if none are available yet, or -1 when the input has ended.
+  typedef int (*SubSymbolSource)(char * subSymbols, size_t maxSize, void * context);
+
  private:
   const uint32_t PAGE_SIZE = 4096;
   typedef struct DMACtrlReg {
     uint32_t cs;       // DMA Channel Control and Status register
     uint32_t cbAddr;   // DMA Channel Control Block Address
+    uint32_t txInfo;   // the loaded control block
+    uint32_t src;
+    uint32_t dest;
+    uint32_t txLen;
+    uint32_t stride;
+    uint32_t nextCB;
+    uint32_t debug;    // DMA Channel Debug register
   } DMACtrlReg;
 
   typedef struct DMAControlBlock {
@@ -92,38 +133,222 @@ class DMAChannel {
     uint32_t padding[2];  // 2-word padding
   } DMAControlBlock;
 
-  typedef struct DMAMemHandle {
-    void *virtualAddr;  // Virutal base address of the page
-    uint32_t busAddr;   // Bus adress of the page, this is not a pointer in user space
-    uint32_t mbHandle;  // Used by mailbox property interface
-    uint32_t size;
-  } DMAMemHandle;
+  typedef DMAArena::Allocation DMAMemHandle;
+
+  // Control block storage is a chain of chunks, each a mailbox block of its own, so a long program needs free GPU
+  // memory but not a contiguous piece of it.  Control block i is in chunk i / CHUNK_CBS, and the last control block
+  // of a chunk links to the first of the next like any other.  A program that fits in one chunk gets one chunk of
+  // its own size.
+  static const uint32_t CHUNK_CBS = 2048;  // 64 KB
+  typedef struct CBStorage {
+    std::vector<DMAMemHandle *> chunks;
+    size_t capacity;  // control blocks
+  } CBStorage;
 
-  int mailboxFD = -1;
-  DMAMemHandle *dmaCBs;
+  Peripheral * peripheralUtil;
+  DMAArena * arena;
+  CBStorage *dmaCBs;
   DMAMemHandle *commandPinToInput;
   DMAMemHandle *commandPinToClock;
   volatile DMACtrlReg *dmaReg;
+  uint32_t keyRegister;  // bus address of the function select register that holds the pin
+  std::vector<uint32_t> keyedPins;  // pins the programs key - the pin, and the outputs of loadOutputs
 
   uint32_t channel;
+  uint32_t cbCount;     // number of control blocks in the compiled program
+
+  // glyph cache - a fragment of control blocks per character, indexed by character
+  DMAMemHandle *glyphCBs;
+  uint32_t glyphClocksPerSubSymbol;
+  int glyphHead[256];
+  int glyphTail[256];
+
+  // streaming mode - a circular ring of key/delay control block pairs (slots) refilled by a producer thread
+  uint32_t ringSlots = 0;
+  std::thread producer;
+  std::atomic<bool> stopStreaming;
+  std::atomic<bool> streaming;
+
+  // queued mode - two programs, one played while the next message is compiled into the other and linked to its end
+  CBStorage *queueCBs[2] = { 0, 0 };
+  uint32_t queueTail[2];  // index of each program's terminating control block
+  int queueLast = 1;      // program queued last
+  uint32_t queued = 0;    // messages queued
+  uint32_t restarts = 0;  // messages that found the channel stopped
+  double minimumSlack = 0.0;
+  static constexpr double QUEUE_LINK_TIMEOUT = 0.01;  // seconds the engine may take to leave the linked tail
+  bool waitToLeave(uint32_t cbAddr, double timeout);
 
-  DMAMemHandle *dmaMalloc(size_t size);
+  // looping - the program is repeated after a gap until the gap's control block is unlinked
+  DMAMemHandle *loopCB = 0;
+  uint64_t loopTicks = 0;  // PCM clocks per cycle, gap included
+  bool looping = false;
+
+  // priority messages - compiled into their own control blocks and spliced in ahead of a character of the message
+  CBStorage *priorityCBs = 0;
+  uint32_t priorityReturn = 0;  // index of the control block the priority message returns to
+  uint32_t priorities = 0;      // priority messages spliced in
+
+  // abort - the engine is diverted to a terminator with a control block per function select register that holds a
+  // keyed pin, each setting those pins to input.  Fixed arrays, so the abort needs nothing but memory accesses.
+  static const int ABORT_REGISTERS_MAXIMUM = 4;
+  static constexpr double ABORT_TIMEOUT = 0.0005;  // seconds the engine has to run the terminator
+  DMAMemHandle *abortCBs = 0;
+  int abortRegisters = 0;
+  uint32_t abortOffsets[ABORT_REGISTERS_MAXIMUM];  // of the function select registers from the GPIO base
+  uint32_t abortMasks[ABORT_REGISTERS_MAXIMUM];    // function select bits of the keyed pins in them
+  volatile uint32_t *gpioReg;
+  volatile bool aborted = false;
+  volatile bool abortForced = false;     // the engine didn't run the terminator in time and the CPU keyed up
+  volatile bool abortConfirmed = false;  // every keyed pin read back as an input
+  volatile double abortLatency = 0.0;    // seconds from the request to the confirmation
+  void addAbortPin(GPIO * gpio);
+  bool keyedPinsDown();
+
+  // completion - the length of the compiled program in PCM clocks predicts when it ends
+  std::atomic<uint64_t> programTicks{0};  // extended by queued and priority messages while the watcher reads it
+  double tickRate = PCMHW::PCM_CLOCK_FREQUENCY;  // PCM clocks per second
+  uint64_t glyphTicks[256];
+  struct timespec startTime;
+  double completionLatency = 0.0;  // seconds between the last poll that saw the program running and detection
+  double completionError = 0.0;    // seconds from the predicted end to detection
+  int completionFD = -1;
+  std::thread watcher;
+  std::atomic<bool> stopWaiting;
+
+  // progress - the control block and PCM clock where each character of the message starts
+  typedef struct CharacterStart {
+    uint32_t cb;
+    uint32_t tick;
+  } CharacterStart;
+  std::vector<CharacterStart> characterStarts;
+
+  // parallel compilation - a long message is split at run boundaries into a segment per thread, and each segment is
+  // compiled into its own range of control blocks
+  typedef struct Segment {
+    CBStorage * storage;    // where the segment is compiled
+    size_t begin;           // subsymbols of the segment
+    size_t end;
+    size_t character;       // first character that starts in the segment
+    size_t characterStart;  // subsymbol where it starts
+    int index;              // first control block
+    std::vector<CharacterStart> starts;
+  } Segment;
+  static const size_t PARALLEL_MINIMUM_SUBSYMBOLS = 1 << 16;
+  unsigned compileThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  // cached programs - the control blocks with each address made relative, in two bits of a relocation byte per
+  // control block (source, destination and next control block, from the low bits up)
+  enum { ABSOLUTE_ADDRESS, PROGRAM_OFFSET, PIN_TO_CLOCK, PIN_TO_INPUT };
+  typedef struct ProgramImage {
+    uint32_t cbCount;
+    uint32_t characterStarts;
+    uint64_t programTicks;
+  } ProgramImage;  // followed by the control blocks, the relocation bytes and the character starts
+  bool glyphProgram = false;
+  bool started = false;
+  StatsPage * statsPage = 0;
+
+  DMAMemHandle *dmaMalloc(size_t size, uint32_t align = sizeof(DMAControlBlock));
   void dmaFree(DMAMemHandle *mem);
-  void dmaAllocBuffers(size_t subSymbolsSize, uint32_t clocksPerSubSymbol, GPIO * gpio);
-  inline DMAControlBlock *ithCBVirtAddr(int i) {
-    return reinterpret_cast<DMAControlBlock *>(dmaCBs->virtualAddr) + i;
+  static size_t countRuns(char * subSymbols, size_t subSymbolsSize);
+  void dmaAllocBuffers(GPIO * gpio);
+  void allocCBs(CBStorage ** storage, size_t controlBlocks);
+  void dmaAllocCBs(size_t controlBlocks);
+  void dmaFreeCBs(CBStorage * storage);
+  void reportStorage();
+  inline DMAControlBlock *cbVirtAddr(CBStorage * storage, uint32_t i) {
+    return reinterpret_cast<DMAControlBlock *>(storage->chunks[i / CHUNK_CBS]->virtualAddr) + i % CHUNK_CBS;
   }
-  inline uint32_t ithCBBusAddr(int i) { return dmaCBs->busAddr + i * sizeof(DMAControlBlock); }
+  inline uint32_t cbBusAddr(CBStorage * storage, uint32_t i) {
+    return storage->chunks[i / CHUNK_CBS]->busAddr + (i % CHUNK_CBS) * sizeof(DMAControlBlock);
+  }
+  int cbIndex(CBStorage * storage, uint32_t busAddr);  // of the control block at busAddr, -1 if not in storage
+  inline DMAControlBlock *ithCBVirtAddr(int i) { return cbVirtAddr(dmaCBs, i); }
+  inline uint32_t ithCBBusAddr(int i) { return cbBusAddr(dmaCBs, i); }
   inline uint32_t commandPinToClockBusAddr() { return commandPinToClock->busAddr; }
   inline uint32_t commandPinToInputBusAddr() { return commandPinToInput->busAddr; }
-  void dmaInitCBs(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol);
+  void setKeyCB(DMAControlBlock * cb, bool keyDown, uint32_t nextCB);
+  void setDelayCB(DMAControlBlock * cb, uint32_t ticks, uint32_t nextCB);
+  void initKeyCB(CBStorage * storage, int index, bool keyDown, int nextIndex = -1);
+  void initDelayCB(CBStorage * storage, int index, uint32_t ticks, int nextIndex = -1);
+  void initKeyCB(int index, bool keyDown, int nextIndex = -1);
+  void initDelayCB(int index, uint32_t ticks, int nextIndex = -1);
+  void initRegisterWriteCB(int index, const RegisterWrite & write);
+  int compileSegment(Segment * segment, char * subSymbols, uint32_t clocksPerSubSymbol, const char * message);
+  int compileRuns(CBStorage * storage, int index, char * subSymbols, size_t subSymbolsSize,
+                  uint32_t clocksPerSubSymbol, const char * message, std::vector<CharacterStart> * starts);
+  int compileProgram(CBStorage * storage, char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol,
+                     const char * message, std::vector<CharacterStart> * starts);
+  void dmaInitCBs(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol, const char * message);
+  void reportProgram(size_t subSymbolsSize, uint32_t clocksPerSubSymbol);
+  void dmaInitGlyphs(uint32_t clocksPerSubSymbol);
+  bool relativeAddress(uint32_t busAddr, uint32_t * kind, uint32_t * relative);
+  bool inQueueProgram(int buffer);
+  bool inPriorityProgram();
+  int programIndex(uint32_t cbAddr);
+  inline uint32_t ringSlotIndex(uint32_t slot) { return 1 + 2 * slot; }
+  void initRingSlot(uint32_t slot, bool keyDown, uint32_t ticks);
+  void dmaInitRing(uint32_t idleTicks);
+  uint32_t ringConsumerSlot();
+  void streamProducer(SubSymbolSource source, void * context, uint32_t clocksPerSubSymbol);
+  double secondsSinceStart();
+  void completionWatcher();
+  void stopWatcher();
   void dmaEnd();
 
  public:
+  // message is the text that was encoded into subSymbols, needed only to report progress by character
+  void loadMessage(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol, const char * message = 0);
+  void loadGlyphMessage(const char * message, uint32_t clocksPerSubSymbol);
+  void loadBeacon(const std::vector<BeaconStep> & steps, uint32_t clocksPerSubSymbol);
+  void loadOutputs(const std::vector<Output> & outputs, uint32_t clocksPerSubSymbol);
+  // loads the program compiled from description (its text and mode) from the cache - false if it isn't there
+  bool loadCachedProgram(ProgramCache * cache, const char * description, uint32_t clocksPerSubSymbol);
+  void cacheProgram(ProgramCache * cache, const char * description, uint32_t clocksPerSubSymbol);
+  void loopProgram(uint32_t gapTicks);  // repeats the loaded program forever, gapTicks PCM clocks apart
+  void stopLoop();  // lets the program end at the end of a cycle
+  uint64_t getLoopCycles();  // cycles completed
   void dmaStart();
+  // Stops the playing program and keys up at once, and is safe to call from a signal handler - returns the
+  // seconds it took to confirm the keyed pins are inputs.  The channel isn't started again.
+  double abortProgram();
+  CBVerifier::Result verifyProgram();  // checks the loaded program in host memory and works out its timeline
+  // compiles a message and links it to the end of the playing program - returns the compile-ahead slack in seconds,
+  // -1 if the channel was not running and had to be started, or -2 if the engine stalled at the end of the
+  // playing program (the message is linked, and sent if the engine moves on)
+  double queueMessage(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol);
+  void reportQueue();
+  // compiles a message and splices it into the playing message at the next character boundary the engine hasn't
+  // reached, returning to the message afterwards - returns the seconds until the engine took the splice, or -1 if
+  // there is no boundary left to splice at
+  double sendPriority(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol);
   bool dmaIsRunning();
+  inline bool dmaIsActive() { return (dmaReg->cs & DMA_ACTIVE) != 0; }
+  inline uint32_t getStatus() { return dmaReg->cs; }
+  inline uint32_t getDebug() { return dmaReg->debug; }
+  void clearErrors(uint32_t errors);  // DMA_DEBUG_* flags
+  bool dmaKeyingStarted();
+  bool waitForCompletion(double timeout);  // true when the program has ended, false after timeout seconds
+  int getCompletionFD();  // eventfd that is signaled each time a started program ends (for poll/epoll)
+  inline double getPredictedDuration() {  // seconds from dmaStart to the end of the program
+    return (programTicks + 1) / tickRate;
+  }
+  inline void setTickRate(double tickRate) { this->tickRate = tickRate; }  // when the PCM isn't paced at 1 KHz
+  inline double getCompletionLatency() { return completionLatency; }
+  inline double getCompletionError() { return completionError; }
+  Progress progress();  // reads where the program is from the control block address register
+  inline void publishProgress(StatsPage * statsPage) { this->statsPage = statsPage; }  // progress() updates it
+  void streamStart(SubSymbolSource source, void * context, uint32_t clocksPerSubSymbol);
+  void streamStop();
+  inline bool streamIsRunning() { return streaming; }
+  inline uint32_t getCBCount() { return cbCount; }
+  inline void setCompileThreads(unsigned threads) { compileThreads = std::max(1u, threads); }
+  inline size_t getDMABytes() { return arena->getMailboxBytes(); }  // mailbox memory held by this channel
   DMAChannel(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol,
              uint32_t channel, GPIO * gpio, Peripheral * peripheralUtil);
+  DMAChannel(uint32_t channel, GPIO * gpio, Peripheral * peripheralUtil);
+  DMAChannel(uint32_t ringSlots, uint32_t channel, GPIO * gpio, Peripheral * peripheralUtil);
   ~DMAChannel(void);
 };
 #endif  // INCLUDE_DMACHANNEL_H_
@@ -0,0 +1,107 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for running the transmitter as a daemon that accepts messages over a Unix domain socket
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_DAEMON_H_
+#define INCLUDE_DAEMON_H_
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "../include/Clock.h"
+#include "../include/DMAChannel.h"
+#include "../include/Logger.h"
+#include "../include/MorseEncoder.h"
+#include "../include/PCMHW.h"
+
+// A client connects, sends one request line and waits for the reply line:
+//   request: <transmission rate> <frequency, 0 to keep the current frequency> <message>\n
+//   reply:   OK queue_wait_ms=<ms> first_key_ms=<ms> done_detect_ms=<ms>\n  or  ERROR <reason>\n
+// The reply is sent when the message has been transmitted.  queue_wait_ms is the time from the request to the
+// start of its transmission, first_key_ms from the request to the first key down, and done_detect_ms how long the
+// end of the message may have gone unnoticed (from the last poll that saw the channel running to detection).
+// A request that starts with "!" is a priority request.  While a message is being sent it is spliced into that
+// message at the next character boundary and the reply, sent when the engine takes the splice, is
+//   OK spliced_ms=<ms from the request to the splice>\n
+// A priority request with a frequency, or one that arrives when there is no message or no boundary left, is sent
+// next, ahead of the other requests, with the usual reply.
+
+class Daemon {
+ private:
+  const size_t MAXIMUM_REQUEST_SIZE = 4096;
+  typedef struct Request {
+    int clientFD;
+    uint32_t rate;
+    uint32_t frequency;
+    char * message;
+    bool priority;
+    struct timespec received;  // when the request was read from the socket
+  } Request;
+
+  const char * socketPath;
+  int listenFD;
+  Clock * clock;
+  DMAChannel * dma;
+  int completionFD;  // signaled by the DMA channel when a message has been sent
+
+  std::deque<Request> queue;
+  std::mutex queueLock;
+  std::condition_variable queueReady;
+  std::deque<Request> priorityQueue;  // guarded by queueLock
+  int priorityFD;  // signaled by the acceptor when a priority request is queued
+  std::thread acceptor;
+  std::atomic<bool> stopping;
+
+  void acceptRequests();
+  bool readRequest(int clientFD, Request * request);
+  void transmit(Request * request, volatile sig_atomic_t * exitRequested);
+  void splicePriorityRequests();
+  void reply(int clientFD, const char * text);
+  static double millisecondsBetween(const struct timespec * from, const struct timespec * to);
+
+ public:
+  void run(volatile sig_atomic_t * exitRequested);
+  Daemon(const char * socketPath, Clock * clock, DMAChannel * dma);
+  ~Daemon(void);
+};
+#endif  // INCLUDE_DAEMON_H_
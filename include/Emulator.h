@@ -0,0 +1,163 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for emulating the peripherals, mailbox memory and DMA engine on an ordinary Linux host
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_EMULATOR_H_
+#define INCLUDE_EMULATOR_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/Clock.h"
+#include "../include/DMAChannel.h"
+#include "../include/GPIO.h"
+#include "../include/HWBackend.h"
+#include "../include/Logger.h"
+#include "../include/PCMHW.h"
+
+// The peripheral registers are plain memory, so the code under test runs unchanged.  The emulated DMA engine
+// walks control block chains, writes to the PCM FIFO wait for FIFO space (DREQ) and the FIFO is drained at the
+// PCM frame rate programmed into the emulated PCM clock and PCM mode registers.  In real time mode PCM clocks
+// follow the wall clock, otherwise they advance as soon as the engine is waiting for one.  Error flags in PCM CS and
+// DMA DEBUG are cleared by writing 1, as the hardware's are.
+class Emulator : public HWBackend {
+ public:
+  typedef struct KeyEdge {
+    uint64_t tick;     // PCM clock of the edge
+    double lateness;   // seconds from the PCM clock to the edge (real time mode only)
+    uint32_t pin;
+    bool keyDown;
+  } KeyEdge;
+
+ private:
+  static const uint32_t EMULATED_PERIPHERAL_BASE = 0x3F000000;
+  static const uint32_t PERIPHERAL_SIZE = 0x01000000;
+  static const uint32_t GPU_PHYS_BASE = 0x08000000;  // physical address of the emulated mailbox memory
+  static const uint32_t EMULATED_PLLD_FREQUENCY = 500000000;
+  static const int DMA_CHANNELS = 15;
+
+  typedef struct Allocation {
+    uint32_t offset;
+    uint32_t size;
+  } Allocation;
+
+  typedef struct ChannelState {
+    bool running;
+    uint32_t cbAddr;   // control block being executed
+    uint32_t txInfo;
+    uint32_t src;
+    uint32_t dest;
+    uint32_t remaining;
+    uint32_t nextCB;
+  } ChannelState;
+
+  typedef struct FlagRegister {
+    uint32_t raised;   // flags set and not yet cleared
+    uint32_t shown;    // the value last put in the register
+  } FlagRegister;
+
+  uint8_t * peripherals;
+  uint8_t * gpuMemory;
+  size_t gpuMemorySize;
+  std::map<uint32_t, Allocation> allocations;  // by handle
+  std::map<uint32_t, uint32_t> freeBlocks;     // offset to size
+  uint32_t nextHandle;
+  std::mutex memoryLock;
+
+  ChannelState channels[DMA_CHANNELS];
+  uint32_t fifoLevel;
+  uint64_t underruns;
+  bool fifoPrimed;
+  bool realTime;
+  double tickRate;             // PCM frames per second
+  struct timespec tickBase;    // real time of tickBaseCount
+  uint64_t tickBaseCount;
+  uint64_t tick;               // PCM clocks so far
+  FlagRegister pcmFlags;       // PCM CS error flags
+  FlagRegister debugFlags[DMA_CHANNELS];  // DMA DEBUG error flags
+  typedef struct WatchedPin {
+    uint32_t pin;
+    bool keyDown;
+    uint64_t keyDownTicks;
+    uint64_t lastEdgeTick;
+  } WatchedPin;
+  std::vector<WatchedPin> watchedPins;
+  std::vector<KeyEdge> timeline;
+  std::mutex timelineLock;
+  std::thread engine;
+  std::atomic<bool> stopping;
+
+  inline volatile uint32_t * reg(uint32_t offset) {
+    return reinterpret_cast<volatile uint32_t *>(peripherals + offset);
+  }
+  void * busToVirtual(uint32_t busAddr);
+  double pcmTickRate();
+  double secondsOfTick(uint64_t tick);
+  void advancePCM();
+  void updateClockStatus();
+  void updateFlags(volatile uint32_t * flagReg, uint32_t flags, uint32_t statusMask, uint32_t status,
+                   FlagRegister * state);
+  void updateErrorFlags();
+  void loadCB(int channel, uint32_t cbAddr);
+  bool stepChannel(int channel, bool * waiting);
+  void writeWord(uint32_t destBusAddr, uint32_t value);
+  void runEngine();
+
+ public:
+  uint32_t peripheralBase();
+  void * mapPhysical(uint32_t physicalAddress, size_t size);
+  void unmapPhysical(void * address, size_t size);
+  int mboxOpen();
+  void mboxClose(int fileDesc);
+  uint32_t memAlloc(int fileDesc, uint32_t size, uint32_t align, uint32_t flags);
+  uint32_t memFree(int fileDesc, uint32_t handle);
+  uint32_t memLock(int fileDesc, uint32_t handle);
+  uint32_t memUnlock(int fileDesc, uint32_t handle);
+  void * mapMem(uint32_t base, uint32_t size);
+  void unmapMem(void * address, uint32_t size);
+
+  void watchPin(uint32_t pin);  // record key edges of this GPIO pin's clock function - any number of pins
+  std::vector<KeyEdge> getTimeline();
+  void writeTimeline(FILE * file);
+  void report();
+  inline uint64_t getTicks() { return tick; }
+  inline uint64_t getUnderruns() { return underruns; }
+  explicit Emulator(bool realTime = true, size_t gpuMemorySize = 256 << 20);
+  ~Emulator(void);
+};
+#endif  // INCLUDE_EMULATOR_H_
@@ -40,15 +40,28 @@ Mark Broihier 2021
 
 // #include <stdint.h>
 // #include <unistd.h>
+#include "../include/Logger.h"
 #include "../include/Peripheral.h"
 
 
+#define GPIO_FSEL_INPUT 0
+#define GPIO_FSEL_ALT0 4
+#define GPIO_FSEL_ALT5 2
+
 class GPIO {
  private:
   volatile uint32_t * gpioModeReg;
  public:
   uint32_t pin;
-  uint32_t pinModeSettings;
+  uint32_t pinModeSettings;  // of the function select register that holds this pin
+  int gpclk;                 // general purpose clock (0, 1 or 2) this pin can output, -1 if none
+  uint32_t clockFunction;    // function select code of that output
+  inline uint32_t fselOffset() { return GPIO_FSEL + 4 * (pin / 10); }
+  inline uint32_t fselShift() { return (pin % 10) * 3; }
+  // function select register contents with this pin switched to its clock output (key down) or to input (key up)
+  inline uint32_t keyWord(uint32_t settings, bool keyDown) {
+    return (settings & ~(7 << fselShift())) | (keyDown ? clockFunction << fselShift() : GPIO_FSEL_INPUT);
+  }
   GPIO(uint32_t pin, Peripheral * peripheralUtil);
   ~GPIO(void);
 };
@@ -0,0 +1,54 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Interface to the hardware - peripheral register mapping and the VideoCore mailbox memory interface
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_HWBACKEND_H_
+#define INCLUDE_HWBACKEND_H_
+#include <stddef.h>
+#include <stdint.h>
+
+// The methods follow mailbox.h.  PiBackend talks to /dev/mem and /dev/vcio, Emulator simulates them.
+class HWBackend {
+ public:
+  virtual uint32_t peripheralBase() = 0;  // physical address of the peripherals
+  virtual void * mapPhysical(uint32_t physicalAddress, size_t size) = 0;
+  virtual void unmapPhysical(void * address, size_t size) = 0;
+  virtual int mboxOpen() = 0;
+  virtual void mboxClose(int fileDesc) = 0;
+  virtual uint32_t memAlloc(int fileDesc, uint32_t size, uint32_t align, uint32_t flags) = 0;
+  virtual uint32_t memFree(int fileDesc, uint32_t handle) = 0;
+  virtual uint32_t memLock(int fileDesc, uint32_t handle) = 0;
+  virtual uint32_t memUnlock(int fileDesc, uint32_t handle) = 0;
+  virtual void * mapMem(uint32_t base, uint32_t size) = 0;
+  virtual void unmapMem(void * address, uint32_t size) = 0;
+  virtual ~HWBackend(void) {}
+};
+#endif  // INCLUDE_HWBACKEND_H_
@@ -0,0 +1,90 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for sampling the PCM, DMA and PLL error and lock flags and exporting them as metrics
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_HEALTHMONITOR_H_
+#define INCLUDE_HEALTHMONITOR_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include "../include/Clock.h"
+#include "../include/DMAChannel.h"
+#include "../include/Logger.h"
+#include "../include/PCMHW.h"
+
+// Every anomaly has a counter of the samples that saw it and the times of the first and last of them.  The flags
+// latch, so one sample can stand for several events.  The metrics are rewritten (write to a temporary file and
+// rename) about once a second in the Prometheus text format, for a node exporter's textfile collector or any
+// scraper that reads files.
+class HealthMonitor {
+ private:
+  enum {
+    PCM_UNDERRUN,
+    DMA_READ_ERROR,
+    DMA_FIFO_ERROR,
+    DMA_READ_LAST_NOT_SET_ERROR,
+    PLLC_UNLOCKED,
+    PLLD_UNLOCKED,
+    ANOMALIES
+  };
+  typedef struct Anomaly {
+    const char * name;
+    const char * help;
+    uint64_t count;
+    double first;   // Unix time, 0 if never seen
+    double last;
+    bool present;   // seen by the latest sample
+  } Anomaly;
+
+  Anomaly anomalies[ANOMALIES];
+  Clock * clock;
+  PCMHW * pcm;
+  DMAChannel * dma;
+  const char * path;
+  double interval;  // seconds between samples
+  uint64_t samples = 0;
+  bool wasActive = false;
+  std::atomic<bool> stopping;
+  std::thread sampler;
+
+  void record(int anomaly, bool seen, double now);
+  void sample();
+  void writeMetrics();
+  void run();
+
+ public:
+  void report();
+  HealthMonitor(const char * path, double samplesPerSecond, Clock * clock, PCMHW * pcm, DMAChannel * dma);
+  ~HealthMonitor(void);
+};
+#endif  // INCLUDE_HEALTHMONITOR_H_
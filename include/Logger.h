@@ -0,0 +1,107 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for logging diagnostics through a lock-free ring drained by a background writer
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_LOGGER_H_
+#define INCLUDE_LOGGER_H_
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// messages above LOG_LEVEL are compiled out - set it with cmake -DMORSE_LOG_LEVEL=<level>
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#define LOG_ENABLED(level) (LOG_LEVEL >= (level))
+
+#define LOG_ERROR(...) do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) Logger::log(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+#define LOG_WARN(...) do { if (LOG_ENABLED(LOG_LEVEL_WARN)) Logger::log(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) do { if (LOG_ENABLED(LOG_LEVEL_INFO)) Logger::log(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) Logger::log(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+
+// Logging formats the message into a preallocated slot of the ring and returns - it never blocks or does I/O, and
+// if the ring is full the message is dropped and counted.  The writer thread writes the text to stderr, or in
+// binary mode writes each Record as it is, for tools.  Everything logged is written out at exit.
+class Logger {
+ public:
+  static const uint32_t TEXT_SIZE = 240;
+  typedef struct Record {
+    uint64_t nanoseconds;  // CLOCK_MONOTONIC when logged
+    uint32_t level;
+    uint32_t length;       // of text, which is not terminated
+    char text[TEXT_SIZE];
+  } Record;
+
+ private:
+  static const uint32_t SLOTS = 1024;  // a power of 2
+  typedef struct Slot {
+    std::atomic<uint64_t> sequence;  // position + 1 once the record is written, position + SLOTS once it is read
+    Record record;
+  } Slot;
+
+  Slot slots[SLOTS];
+  std::atomic<uint64_t> head;  // next position to log to
+  uint64_t tail;               // next position to write out - writer thread only
+  std::atomic<uint64_t> written;
+  std::atomic<uint64_t> dropped;
+  std::atomic<bool> stopping;
+  // the sink - configure() sets the next one and the position from which it is used, and the writer switches to
+  // it there, so each record is written whole to one sink in one format
+  std::mutex sinkLock;
+  FILE * output;
+  bool binary;
+  FILE * nextOutput;
+  bool nextBinary;
+  uint64_t switchPosition;
+  bool switchPending;
+  std::thread writer;
+
+  static Logger * instance();
+  static void shutdown();
+  bool drain();
+  void writeLoop();
+  Logger();
+
+ public:
+  static void log(uint32_t level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+  static void configure(FILE * output, bool binary);  // where the writer writes what is logged from now on, and how
+  static void flush();  // waits until everything logged so far has been written
+  static uint64_t getDropped();
+};
+#endif  // INCLUDE_LOGGER_H_
@@ -0,0 +1,68 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for encoding text into Morse code subsymbols
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_MORSEENCODER_H_
+#define INCLUDE_MORSEENCODER_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/Logger.h"
+
+class MorseEncoder {
+ public:
+  // a character's subsymbols, one bit per subsymbol starting with the least significant bit (1 is key down)
+  typedef struct PackedGlyph {
+    uint32_t subSymbols;
+    uint8_t length;  // number of subsymbols, 0 if the character can't be encoded
+  } PackedGlyph;
+
+  static const size_t ENCODING_ERROR = SIZE_MAX;
+  static const uint32_t MAXIMUM_SUBSYMBOLS_PER_CHARACTER = 22;
+  static const uint32_t MAXIMUM_RUNS_PER_CHARACTER = 10;
+  // a run of identical subsymbols - the number of subsymbols, or'ed with RUN_KEY_DOWN for key down runs
+  static const uint32_t RUN_KEY_DOWN = 1u << 31;
+
+  static char characterAt(uint32_t index);  // characters in the translation table, 0 past the end
+  static PackedGlyph packedGlyph(char character);
+  static bool isEncodable(const char * message);
+  // Encoders into caller supplied buffers.  They return the number of subsymbols (or runs) written, or
+  // ENCODING_ERROR if a character can't be encoded or the buffer is too small.
+  static size_t encode(const char * message, size_t messageLength, char * encodedMessage, size_t maxEncodedLength);
+  static size_t encodeBits(const char * message, size_t messageLength, uint8_t * packedMessage,
+                           size_t maxSubSymbols);
+  static size_t encodeRuns(const char * message, size_t messageLength, uint32_t * runs, size_t maxRuns);
+  static size_t characterToMorse(char character, char * encodedCharacter, size_t maxEncodedLength);
+  // encodes a message (logged when debugging), and exits if the message can't be encoded
+  static size_t messageToMorse(const char * message, char * encodedMessage, size_t maxEncodedLength);
+};
+#endif  // INCLUDE_MORSEENCODER_H_
@@ -32,9 +32,11 @@ Mark Broihier 2021
 
 #ifndef INCLUDE_PCMHW_H_
 #define INCLUDE_PCMHW_H_
+#include <math.h>
 #include <stdint.h>
 #include <unistd.h>
 #include "../include/Clock.h"
+#include "../include/Logger.h"
 #include "../include/Peripheral.h"
 
 /* PWM mapping information */
@@ -46,6 +48,15 @@ Mark Broihier 2021
 
 /* PCM control bits */
 #define PCM_CTL_EN   (1 << 0)
+#define PCM_CTL_TXON (1 << 2)
+#define PCM_CTL_TXCLR (1 << 3)
+#define PCM_CTL_RXCLR (1 << 4)
+#define PCM_CTL_DMAEN (1 << 9)
+#define PCM_CTL_TXERR (1 << 15)  // transmit FIFO underrun, cleared by writing 1
+#define PCM_CTL_RXERR (1 << 16)
+#define PCM_CTL_STATUS 0x007e6000  // read only FIFO status bits (TXSYNC, RXSYNC, TXW, RXR, TXD, RXD, TXE, RXF)
+#define PCM_CTL_SYNC (1 << 24)  // reads back what was written two PCM clocks later
+#define PCM_SYNC_TIMEOUT 0.01  // seconds
 
 #define PCM_ENABLE_CHANNEL_1 (1 << 30)
 
@@ -66,10 +77,23 @@ class PCMHW {
 
   Clock * clock;
   volatile PCMCtrlReg * pcmReg;
+  double tickRate = PCM_CLOCK_FREQUENCY;  // PCM clocks (DREQs) per second
+
+  void startPCM(uint32_t control, uint32_t divider, uint32_t frameLength);
 
  public:
+  static const uint32_t PCM_CLOCK_FREQUENCY = 1000;  // 1 msec per PCM clock (DMA pacing tick)
   void initPCM();
   uint32_t setPCMFrequency(uint32_t rate);
+  // paces at a whole number of PCM clocks per dit (usually one) instead of 1 KHz, returns PCM clocks per dit
+  uint32_t setDitFrequency(double wordsPerMinute);
+  inline double getTickRate() { return tickRate; }
+  inline uint32_t getStatus() { return pcmReg->ctrl; }
+  void clearErrors(uint32_t errors);
+  // rate is words per min which turns out to be standardized to 0.120 seconds / subsymbol for 10 words per min
+  // To get calculate the clocks per subsymbol for a rate we do this:
+  // 120 clocks/subsymbol * 10 words/min / rate words/min = clocks per subsymbol
+  static inline uint32_t clocksPerSubSymbol(uint32_t rate) { return 1200 / rate; }
   explicit PCMHW(Clock * clock, Peripheral * peripheralUtil);
   ~PCMHW(void);
 };
@@ -32,33 +32,60 @@ Mark Broihier 2021
 
 #ifndef INCLUDE_PERIPHERAL_H_
 #define INCLUDE_PERIPHERAL_H_
-#include <bcm_host.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include "../include/HWBackend.h"
+#include "../include/Logger.h"
 
+// a write of a peripheral register from a DMA program, followed by a delay in PCM clocks
+typedef struct RegisterWrite {
+  uint32_t offset;  // from the peripheral base
+  uint32_t value;
+  uint32_t delayTicks;
+} RegisterWrite;
+
+// Mappings are page granular and kept until unmapPeripherals().  A request that falls inside an existing mapping
+// is served from it, so mapping cost does not grow with the number of users of a peripheral page.
 class Peripheral {
  private:
-  typedef struct Mappings {
-    void * peripheralAddress;
-    uint32_t offsetFromBase;
+  static const uint32_t PAGE_SIZE = 4096;
+  typedef struct Mapping {
+    uint8_t * peripheralAddress;
     size_t size;
-    Mappings * nextMap;
-  } Mappings;
+  } Mapping;
 
-  Mappings * listOfMappings;
-  Mappings * listOfMappingsHead;
+  std::map<uint32_t, Mapping> mappings;  // by page aligned offset from the peripheral base
+  std::vector<Mapping> superseded;
 
   uint32_t PERI_PHYS_BASE;
+  HWBackend * hw;
+
+  uint32_t mapCount;
+  uint32_t reuseCount;
+  uint32_t unmapCount;
+  double mapSeconds;
 
  public:
   void * mapPeripheralToUserSpace(uint32_t addr, size_t size);
   void unmapPeripherals();
+  void reportMappings();
+  inline uint32_t getMapCount() { return mapCount; }
+  inline uint32_t getReuseCount() { return reuseCount; }
+  inline uint32_t getUnmapCount() { return unmapCount; }
+  inline HWBackend * backend() { return hw; }
   Peripheral();
+  explicit Peripheral(HWBackend * backend);  // takes ownership of the backend
   ~Peripheral(void);
 };
 #endif  // INCLUDE_PERIPHERAL_H_
@@ -0,0 +1,68 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for accessing the Raspberry Pi hardware through /dev/mem and the VideoCore mailbox
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_PIBACKEND_H_
+#define INCLUDE_PIBACKEND_H_
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef HAVE_BCM_HOST
+#include <bcm_host.h>
+#endif
+#include "../include/HWBackend.h"
+#include "../include/mailbox.h"
+
+class PiBackend : public HWBackend {
+ private:
+  int memFD;  // /dev/mem, opened on the first mapping and kept open for the rest
+
+ public:
+  uint32_t peripheralBase();
+  void * mapPhysical(uint32_t physicalAddress, size_t size);
+  void unmapPhysical(void * address, size_t size);
+  inline int mboxOpen() { return mbox_open(); }
+  inline void mboxClose(int fileDesc) { mbox_close(fileDesc); }
+  inline uint32_t memAlloc(int fileDesc, uint32_t size, uint32_t align, uint32_t flags) {
+    return mem_alloc(fileDesc, size, align, flags);
+  }
+  inline uint32_t memFree(int fileDesc, uint32_t handle) { return mem_free(fileDesc, handle); }
+  inline uint32_t memLock(int fileDesc, uint32_t handle) { return mem_lock(fileDesc, handle); }
+  inline uint32_t memUnlock(int fileDesc, uint32_t handle) { return mem_unlock(fileDesc, handle); }
+  inline void * mapMem(uint32_t base, uint32_t size) { return mapmem(base, size); }
+  inline void unmapMem(void * address, uint32_t size) { unmapmem(address, size); }
+  PiBackend(void);
+  ~PiBackend(void);
+};
+#endif  // INCLUDE_PIBACKEND_H_
@@ -0,0 +1,75 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for keeping compiled control block programs in files so that repeated messages aren't compiled again
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_PROGRAMCACHE_H_
+#define INCLUDE_PROGRAMCACHE_H_
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "../include/Logger.h"
+
+// A program is stored in <directory>/<key>.cbp, where the key is a hash of what the program was compiled from (the
+// text and mode), the PCM clocks per subsymbol, the PCM clock rate and the keyed pin.  The file holds the key, the
+// description it was made from (compared on load, so a hash collision is a miss) and the image - the channel's
+// control blocks with their addresses made relative, which it relocates into DMA memory on load.
+class ProgramCache {
+ private:
+  static const uint32_t MAGIC = 0x50424d43;  // "CMBP"
+  static const uint32_t VERSION = 1;
+  typedef struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t descriptionSize;
+    uint32_t imageSize;
+  } FileHeader;
+
+  char directory[256];
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  uint32_t stores = 0;
+
+  void fileName(uint64_t key, char * name, size_t size);
+
+ public:
+  static uint64_t key(const char * description, uint32_t clocksPerSubSymbol, double tickRate, uint32_t pin);
+  bool load(uint64_t key, const char * description, std::vector<uint8_t> * image);  // false on a miss
+  void store(uint64_t key, const char * description, const std::vector<uint8_t> & image);
+  void report();
+  explicit ProgramCache(const char * directory);
+  ~ProgramCache(void);
+};
+#endif  // INCLUDE_PROGRAMCACHE_H_
@@ -0,0 +1,75 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Class for publishing transmission progress in a shared memory page that monitors can read without syscalls
+
+Mark Broihier 2021
+*/
+
+#ifndef INCLUDE_STATSPAGE_H_
+#define INCLUDE_STATSPAGE_H_
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include "../include/Logger.h"
+
+typedef struct Progress {
+  uint32_t running;     // 1 while the DMA channel is active
+  uint32_t character;   // offset in the message of the character being sent
+  uint32_t characters;  // length of the message
+  uint32_t reserved;
+  double elapsed;       // seconds since the transmission started
+  double remaining;     // seconds until the predicted end
+  double percent;       // of the message's PCM clocks that have been sent
+} Progress;
+
+// The page is guarded by a sequence lock: the transmitter makes the sequence odd, writes, and makes it even again.
+// A reader copies the progress and retries if the sequence was odd or changed while it was copying.
+class StatsPage {
+ private:
+  static const uint32_t VERSION = 1;
+  typedef struct Page {
+    std::atomic<uint32_t> sequence;
+    uint32_t version;
+    Progress progress;
+  } Page;
+
+  char name[64];
+  bool owner;
+  Page * page;
+
+ public:
+  void publish(const Progress & progress);
+  bool read(Progress * progress);  // false if a consistent copy could not be read
+  StatsPage(const char * name, bool owner);  // the owner (transmitter) creates and removes the page
+  ~StatsPage(void);
+};
+#endif  // INCLUDE_STATSPAGE_H_
@@ -0,0 +1,212 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+DMA control block program verifier
+
+Mark Broihier 2021
+*/
+
+#include "../include/CBVerifier.h"
+#include "../include/DMAChannel.h"
+
+/* DMA control block "info" field bits checked here */
+#define DMA_TDMODE (1 << 1)
+#define DMA_DEST_INC (1 << 4)
+#define DMA_SRC_INC (1 << 8)
+#define DMA_PERMAP(x) (((x) >> 16) & 0x1f)
+
+#define PERI_BUS_SIZE 0x01000000
+#define GPIO_FSEL_REGISTERS 6
+
+CBVerifier::CBVerifier(double tickRate) {
+  this->tickRate = tickRate;
+}
+
+void CBVerifier::addRegion(uint32_t busAddr, void * virtualAddr, size_t size) {
+  Region region = { busAddr, reinterpret_cast<uint8_t *>(virtualAddr), size };
+  regions.push_back(region);
+}
+
+void CBVerifier::watchPin(uint32_t pin) {
+  pins.push_back(pin);
+}
+
+bool CBVerifier::inRegion(uint32_t busAddr, size_t size) {
+  for (Region & region : regions) {
+    if (busAddr >= region.busAddr && busAddr - region.busAddr + size <= region.size) return true;
+  }
+  return false;
+}
+
+uint32_t CBVerifier::readWord(uint32_t busAddr) {
+  auto written = overlay.find(busAddr);
+  if (written != overlay.end()) return written->second;
+  for (Region & region : regions) {
+    if (busAddr >= region.busAddr && busAddr - region.busAddr + 4 <= region.size) {
+      return *reinterpret_cast<uint32_t *>(region.virtualAddr + (busAddr - region.busAddr));
+    }
+  }
+  return 0;
+}
+
+void CBVerifier::error(Result & result, uint32_t cbAddr, const char * problem) {
+  result.errors++;
+  result.valid = false;
+  LOG_WARN("CB verify: control block %8.8x (number %llu): %s\n", cbAddr,
+           static_cast<unsigned long long>(result.executed), problem);
+}
+
+// Each control block is decoded into one of: a write of words to the PCM FIFO (a delay, paced by DREQ), a write to
+// a function select register (a key edge for the watched pins in it), a write to another peripheral register
+// (a retune), or a write to DMA memory (a link).  The function select registers start with the watched pins set to
+// input.
+CBVerifier::Result CBVerifier::verify(uint32_t firstCB, uint64_t maximumBlocks) {
+  Result result = { true, false, false, 0, 0, 0, 0, 0, 0, 0, std::vector<Edge>() };
+  overlay.clear();
+  std::vector<uint64_t> keyDownAt(pins.size(), 0);
+  std::vector<bool> keyed(pins.size(), false);
+  std::unordered_set<uint32_t> used;
+  uint32_t programStart = 0;  // the control block after the FIFO fill - coming back to it means the program loops
+  uint64_t startTick = 0;
+  uint32_t cbAddr = firstCB;
+  while (cbAddr) {
+    if (result.executed == 1) {
+      programStart = cbAddr;
+      startTick = result.fifoWords > PCM_FIFO_SIZE ? result.fifoWords - PCM_FIFO_SIZE : 0;
+    } else if (result.executed > 1 && cbAddr == programStart) {
+      result.loops = true;
+      break;
+    }
+    if (result.executed >= maximumBlocks) {
+      error(result, cbAddr, "no end to the chain");
+      break;
+    }
+    if (cbAddr % 32) {
+      error(result, cbAddr, "not aligned to 32 bytes");
+      break;
+    }
+    if (!inRegion(cbAddr, 32)) {
+      error(result, cbAddr, "outside of DMA memory");
+      break;
+    }
+    used.insert(cbAddr);
+    uint32_t txInfo = readWord(cbAddr);
+    uint32_t src = readWord(cbAddr + 4);
+    uint32_t dest = readWord(cbAddr + 8);
+    uint32_t txLen = readWord(cbAddr + 12);
+    uint32_t stride = readWord(cbAddr + 16);
+    uint32_t nextCB = readWord(cbAddr + 20);
+    LOG_DEBUG("CB %8.8x TXINFO %8.8x SRC %8.8x DEST %8.8x LEN %8.8x NEXT %8.8x\n", cbAddr, txInfo, src, dest,
+              txLen, nextCB);
+    result.executed++;
+    if ((txInfo & DMA_TDMODE) || stride) {
+      error(result, cbAddr, "2D transfers are not used");
+    }
+    if (txLen == 0 || txLen % 4) {
+      error(result, cbAddr, "length is not a whole number of words");
+    }
+    if (!inRegion(src, (txInfo & DMA_SRC_INC) ? txLen : 4)) {
+      error(result, cbAddr, "source outside of DMA memory");
+    }
+    bool paced = (txInfo & DMA_DEST_DREQ) != 0;
+    if (dest == PERI_BUS_BASE + PCM_BASE + PCM_FIFO) {
+      if (!paced || DMA_PERMAP(txInfo) != PCM_TX) {
+        error(result, cbAddr, "PCM FIFO write not paced by the PCM transmit DREQ");
+      }
+      result.fifoWords += txLen / 4;
+    } else if (paced) {
+      error(result, cbAddr, "DREQ pacing on a write to something other than the PCM FIFO");
+    } else if (dest >= PERI_BUS_BASE + GPIO_BASE + GPIO_FSEL &&
+               dest < PERI_BUS_BASE + GPIO_BASE + GPIO_FSEL + 4 * GPIO_FSEL_REGISTERS) {
+      uint32_t reg = (dest - PERI_BUS_BASE - GPIO_BASE - GPIO_FSEL) / 4;
+      if (txLen != 4 || dest % 4) {
+        error(result, cbAddr, "function select write is not one aligned word");
+      }
+      uint32_t word = readWord(src);
+      uint64_t tick = result.fifoWords > PCM_FIFO_SIZE ? result.fifoWords - PCM_FIFO_SIZE : 0;
+      for (size_t watched = 0; watched < pins.size(); watched++) {
+        if (pins[watched] / 10 != reg) continue;
+        bool keyDown = ((word >> ((pins[watched] % 10) * 3)) & 7) != GPIO_FSEL_INPUT;
+        if (keyDown != keyed[watched]) {
+          Edge edge = { pins[watched], keyDown, tick };
+          result.edges.push_back(edge);
+          if (keyDown) {
+            keyDownAt[watched] = tick;
+          } else {
+            result.keyDownTicks += tick - keyDownAt[watched];
+          }
+          keyed[watched] = keyDown;
+        }
+      }
+    } else if (dest >= PERI_BUS_BASE && dest - PERI_BUS_BASE < PERI_BUS_SIZE) {
+      result.registerWrites++;
+    } else if (inRegion(dest, (txInfo & DMA_DEST_INC) ? txLen : 4)) {
+      if (txLen == 4) {
+        overlay[dest] = readWord(src);
+      } else {
+        error(result, cbAddr, "multiple word write to DMA memory");
+      }
+    } else {
+      error(result, cbAddr, "destination is neither a peripheral nor DMA memory");
+    }
+    cbAddr = nextCB;
+  }
+  result.terminated = cbAddr == 0;
+  result.ticks = result.fifoWords > PCM_FIFO_SIZE ? result.fifoWords - PCM_FIFO_SIZE : 0;
+  if (result.loops) {
+    result.ticks -= startTick;  // one cycle
+  }
+  result.distinct = used.size();
+  for (size_t watched = 0; watched < pins.size(); watched++) {
+    if (keyed[watched]) {
+      if (result.terminated) {
+        LOG_WARN("CB verify: the program ends with GPIO %d keyed\n", pins[watched]);
+        result.errors++;
+        result.valid = false;
+      }
+      result.keyDownTicks += result.ticks - keyDownAt[watched];
+    }
+  }
+  return result;
+}
+
+void CBVerifier::report(const Result & result) {
+  LOG_INFO("CB verify: %s, %s, %llu control blocks executed, %llu used (%llu bytes), %llu FIFO words, "
+           "%d register writes\n", result.valid ? "valid" : "INVALID",
+           result.loops ? "loops" : result.terminated ? "terminates" : "does not terminate",
+           static_cast<unsigned long long>(result.executed), static_cast<unsigned long long>(result.distinct),
+           static_cast<unsigned long long>(result.distinct * 32), static_cast<unsigned long long>(result.fifoWords),
+           result.registerWrites);
+  LOG_INFO("CB verify: %llu PCM clocks (%.3f seconds)%s, key down %llu PCM clocks (%.3f seconds), %d key edges\n",
+           static_cast<unsigned long long>(result.ticks), result.ticks / tickRate, result.loops ? " per cycle" : "",
+           static_cast<unsigned long long>(result.keyDownTicks), result.keyDownTicks / tickRate,
+           static_cast<uint32_t>(result.edges.size()));
+  for (const Edge & edge : result.edges) {
+    LOG_DEBUG("CB verify: GPIO %d key %s at %llu (%.6f seconds)\n", edge.pin, edge.keyDown ? "down" : "up",
+              static_cast<unsigned long long>(edge.tick), edge.tick / tickRate);
+  }
+}
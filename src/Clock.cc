@@ -32,53 +32,127 @@ Mark Broihier 2021
 
 #include "../include/Clock.h"
 
+// GP0 divider and PLLC multiplier for a frequency - PLLC is run as fast as it can go (up to 1.5 GHz)
+Clock::FrequencyPlan Clock::planFrequency(uint32_t frequency) {
+  FrequencyPlan plan;
+  // find divider for PLL C clock
+  uint32_t divider = 0;
+  for (divider = 4095; divider > 1; divider--) {
+    if ((uint64_t)frequency * divider < 200e6) {
+      continue;
+    }
+    if ((uint64_t)frequency * divider > 1500e6) {
+      continue;
+    }
+    break;
+  }
+  if ((uint64_t)frequency * divider < 200e6 || (uint64_t)frequency * divider > 1500e6) {
+    LOG_ERROR("Couldn't find an acceptable divider for %d Hz\n", frequency);
+    exit(-1);
+  }
+  double multiplier = (static_cast<double>(frequency) * divider) / static_cast<double>(XOSC_FREQUENCY);
+  uint32_t scaledMultiplier = multiplier * static_cast<double>(1 << 20);
+  plan.frequency = frequency;
+  plan.divider = divider;
+  plan.gp0Div = BCM_PASSWD | CLK_DIV_DIVI(divider);
+  plan.pllcFrac = BCM_PASSWD | (scaledMultiplier & 0xfffff);
+  plan.pllcCtrl = BCM_PASSWD | (scaledMultiplier >> 20) | (0x21 << 12);  // PDIV of 1, PRSTN (start?)
+  plan.actualFrequency = XOSC_FREQUENCY * (scaledMultiplier / static_cast<double>(1 << 20)) / divider;
+  plan.error = plan.actualFrequency - frequency;
+  return plan;
+}
+
+// Register writes that retune GP0 while the key is up: stop GP0, wait for it to go idle, program the divider and
+// PLLC, wait for PLLC to lock, and start GP0 again.  The delays are in PCM clocks.
+std::vector<RegisterWrite> Clock::retuneSequence(const FrequencyPlan & plan) {
+  const uint32_t GP0_STOP_TICKS = 1;
+  const uint32_t PLLC_LOCK_TICKS = 2;
+  uint32_t gp0Control = (gp0ControlCopy & ~0x3f & 0xffffff) | BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLC);
+  std::vector<RegisterWrite> writes = {
+    { CM_BASE + GP0CLK * 8, gp0Control, GP0_STOP_TICKS },
+    { CM_BASE + GP0CLK * 8 + 4, plan.gp0Div, 0 },
+    { CM_BASE + PLLC_FRAC * 8, plan.pllcFrac, 0 },
+    { CM_BASE + PLLC_CTRL * 8, plan.pllcCtrl, PLLC_LOCK_TICKS },
+    { CM_BASE + GP0CLK * 8, gp0Control | CLK_CTL_ENAB, 0 }
+  };
+  return writes;
+}
+
+void Clock::reportPlan(const FrequencyPlan & plan) {
+  LOG_INFO("%10d Hz: GP0 divider %4d, PLLC_CTRL %8.8x, PLLC_FRAC %8.8x, actual %.3f Hz (error %+.3f Hz)\n",
+           plan.frequency, plan.divider, plan.pllcCtrl, plan.pllcFrac, plan.actualFrequency, plan.error);
+}
+
+// program the GP0 divider and the PLLC multiplier for the center frequency
+void Clock::tuneClock() {
+  plan = planFrequency(centerFrequency);
+  LOG_INFO("PLL C divider will be %d for center frequency of %d\n", plan.divider, centerFrequency);
+  clkReg[GP0CLK].div = plan.gp0Div;
+  clkReg[PLLC_FRAC].ctrl = plan.pllcFrac;
+  LOG_DEBUG("Sending PLLC control command of %8.8x\n", plan.pllcCtrl);
+  clkReg[PLLC_CTRL].ctrl = plan.pllcCtrl;
+  // check for frequency lock of PLLC before GP0 is run from it - once the lock of the old frequency has had time to
+  // drop
+  usleep(CM_LOCK_SETTLE);
+  double planned = plan.actualFrequency * plan.divider;  // PLLC
+  if (waitForRegister(&clkReg[CM_LOCK].div, CM_LOCK_FLOCKC, CM_LOCK_FLOCKC, CM_LOCK_TIMEOUT, "PLLC lock")) {
+    LOG_INFO("PLLC clock has locked into its frequency of %.0f Hz.\n", planned);
+  } else {
+    LOG_WARN("PLLC clock has failed to lock into its frequency of %.0f Hz.\n", planned);
+  }
+  endPhase("PLLC program and lock");
+  // must turn off kill while enabling GP0 clock
+  clkReg[GP0CLK].ctrl = (gp0ControlCopy & ~0x3f) | BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLC) | CLK_CTL_ENAB;
+  waitForRegister(&clkReg[GP0CLK].ctrl, CLK_CTL_BUSY, CLK_CTL_BUSY, CLK_CTL_BUSY_TIMEOUT, "GP0 clock start");
+  endPhase("GP0 clock start");
+
+  uint32_t pllCtl = clkReg[PLLC_CTRL].ctrl;
+  uint32_t pllFrac = clkReg[PLLC_FRAC].ctrl;
+  uint32_t pllPer = clkReg[PLLC_PER].ctrl;
+  frequency = ((XOSC_FREQUENCY * ((uint64_t)pllCtl & 0x3ff) + (XOSC_FREQUENCY * (uint64_t)pllFrac) / (1 << 20)) /
+               (2 * pllPer >> 1)) / ((pllCtl >> 12) & 0x7) * 2;
+  LOG_DEBUG("PLL C frequency should now be %lu\n", frequency);
+  reportPlan(plan);
+  pllcFrequency = static_cast<uint64_t>(planned + 0.5);  // the read back registers carry the password
+}
+
 void Clock::initClock() {
   // PLLC is going to be used to drive RF signal.  Since other things are using PLLC,  those things need to use
   // other clock sources that are stable.
 
   // Switch core clock over to PLLA
   clkReg[CORECLK].div = BCM_PASSWD | CLK_DIV_DIVI(4);
-  usleep(100);
   clkReg[CORECLK].ctrl = BCM_PASSWD | CLK_CTL_ENAB | CLK_CTL_SRC(CLK_CTL_SRC_PLLA);
 
   // Switch EMMC to PLLD
   uint32_t clockControlCopy = clkReg[EMMCCLK].ctrl;
-  // kill the clock if busy
   if (clkReg[EMMCCLK].ctrl & CLK_CTL_BUSY) {
-    do {
-      fprintf(stderr, "EMMCCLK is busy\n");
-      // turn off enable for graceful stop
-      clkReg[EMMCCLK].ctrl = BCM_PASSWD || (clockControlCopy & (!CLK_CTL_ENAB));
-    } while (clkReg[EMMCCLK].ctrl & CLK_CTL_BUSY);
-    fprintf(stderr, "EMMCCLK has stopped\n");
+    LOG_DEBUG("EMMCCLK is busy\n");
+    // turn off enable for graceful stop
+    clkReg[EMMCCLK].ctrl = BCM_PASSWD | (clockControlCopy & ~CLK_CTL_ENAB);
+    if (waitForRegister(&clkReg[EMMCCLK].ctrl, CLK_CTL_BUSY, 0, CLK_CTL_BUSY_TIMEOUT, "EMMC clock stop")) {
+      LOG_DEBUG("EMMCCLK has stopped\n");
+    }
   }
   clockControlCopy = clkReg[EMMCCLK].ctrl;
 
   // Set clock source to plld
   clkReg[EMMCCLK].ctrl = BCM_PASSWD | (CLK_CTL_SRC(CLK_CTL_SRC_PLLD) | (clockControlCopy & ~0xf));
-  usleep(100);
 
   // Enable the EMMC clock
   clkReg[EMMCCLK].ctrl |= BCM_PASSWD | CLK_CTL_ENAB;
+  waitForRegister(&clkReg[EMMCCLK].ctrl, CLK_CTL_BUSY, CLK_CTL_BUSY, CLK_CTL_BUSY_TIMEOUT, "EMMC clock start");
+  endPhase("core and EMMC clocks off PLLC");
 
   // set GP0 Clock to PLLC
+  stopClock(GP0CLK, "GP0CLK");
   clockControlCopy = clkReg[GP0CLK].ctrl;
-  if (clkReg[GP0CLK].ctrl & CLK_CTL_BUSY) {
-    fprintf(stderr, "GP0CLK is busy\n");
-    do {
-      // turn off enable and send kill - turning off enable doesn't seem to be enough
-      fprintf(stderr, "Sending GP0CLK control %8.8x\n",
-              BCM_PASSWD | (clockControlCopy & (!CLK_CTL_ENAB)) | CLK_CTL_KILL);
-      clkReg[GP0CLK].ctrl = BCM_PASSWD | (clockControlCopy & (!CLK_CTL_ENAB)) | CLK_CTL_KILL;
-    } while (clkReg[GP0CLK].ctrl & CLK_CTL_BUSY);
-    fprintf(stderr, "GP0CLK has stopped\n");
-  }
-  clockControlCopy = clkReg[GP0CLK].ctrl;
-  fprintf(stderr, "Current clock control copy: %8.8x\n", clockControlCopy);
+  gp0ControlCopy = clockControlCopy;
+  LOG_DEBUG("Current clock control copy: %8.8x\n", clockControlCopy);
+  endPhase("GP0 clock stop");
   // must turn off kill
 
   clkReg[CM_PLLC].ctrl = BCM_PASSWD | 0x22A;  // enable PLLC_PER
-  usleep(100);
 
   clkReg[PLLC_CORE].ctrl = BCM_PASSWD | (1 << 8);  // disable what?
   clkReg[PLLC_PER].ctrl = BCM_PASSWD | (1 << 0);  // divisor 1 for max frequency
@@ -91,65 +165,13 @@ void Clock::initClock() {
   pllPer = clkReg[PLLC_PER].ctrl;
   frequency = ((XOSC_FREQUENCY * ((uint64_t)pllCtl & 0x3ff) + (XOSC_FREQUENCY * (uint64_t)pllFrac) / (1 << 20)) /
                (2 * pllPer >> 1)) / ((pllCtl >> 12) & 0x7) * 2;
-  fprintf(stderr, "PLL C frequency %lu\n", frequency);
-  pllcFrequency = frequency;
-  // find divider for PLL C clock
-  uint32_t divider = 0;
-  for (divider = 4095; divider > 1; divider--) {
-    if ((uint64_t)centerFrequency * divider < 200e6) {
-      fprintf(stderr, "divider shouldn't get this small - %d\n", divider);
-      continue;
-    }
-    if ((uint64_t)centerFrequency * divider > 1500e6) {
-      continue;
-    }
-    break;
-  }
-  fprintf(stderr, "PLL C divider will be %d for center frequency of %d\n", divider, centerFrequency);
-  if (divider == 0) {
-    fprintf(stderr, "Couldn't find an acceptable divider\n");
-    exit(-1);
-  }
-  clkReg[GP0CLK].div = BCM_PASSWD | CLK_DIV_DIVI(divider);
-  usleep(100);
-  double multiplier = (static_cast<double>(centerFrequency) * divider) / static_cast<double>(XOSC_FREQUENCY);
-  uint32_t scaledMultiplier = multiplier * static_cast<double>(1 << 20);
-  uint32_t integerPortion = scaledMultiplier >> 20;
-  uint32_t fractionalPortion = scaledMultiplier & 0xfffff;
-  clkReg[PLLC_FRAC].ctrl = BCM_PASSWD | fractionalPortion;
-  usleep(100);
-  fprintf(stderr, "Sending PLLC control command of %8.8x\n", BCM_PASSWD | integerPortion | (0x21 << 12));
-  clkReg[PLLC_CTRL].ctrl = BCM_PASSWD | integerPortion | (0x21 << 12);  // PDIV of 1, PRSTN (start?)
-  usleep(100);
-  // must turn off kill while enabling GP0 clock
-  clkReg[GP0CLK].ctrl = (clockControlCopy & ~0x3f) | BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLC) | CLK_CTL_ENAB;
-  usleep(100);
-  // check for frequency lock of PLLC
-  fprintf(stderr, "CM_LOCK address %p\n", &clkReg[CM_LOCK].div);
-  fprintf(stderr, "CM_LOCK value: %8.8x\n", clkReg[CM_LOCK].div);
-  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKC > 0) {
-    fprintf(stderr, "PLLC clock has locked into its frequency of %lu Hz.\n", pllcFrequency);
-  } else {
-    fprintf(stderr, "PLLC clock has failed to lock into its frequency of %lu Hz.\n", pllcFrequency);
-  }
-
-  pllCtl = clkReg[PLLC_CTRL].ctrl;
-  pllFrac = clkReg[PLLC_FRAC].ctrl;
-  pllPer = clkReg[PLLC_PER].ctrl;
-  frequency = ((XOSC_FREQUENCY * ((uint64_t)pllCtl & 0x3ff) + (XOSC_FREQUENCY * (uint64_t)pllFrac) / (1 << 20)) /
-               (2 * pllPer >> 1)) / ((pllCtl >> 12) & 0x7) * 2;
-  fprintf(stderr, "PLL C frequency should now be %lu\n", frequency);
-  fprintf(stderr, "Multiplier should be %f\n", static_cast<double>(scaledMultiplier)/static_cast<double>(1<<20));
+  LOG_DEBUG("PLL C frequency %lu\n", frequency);
   pllcFrequency = frequency;
+  tuneClock();
 
   // now lets set the PCM clock control
-  // kill the clock if busy
-  if (clkReg[PCMCLK].ctrl & CLK_CTL_BUSY) {
-    do {
-      clkReg[PCMCLK].ctrl = BCM_PASSWD | CLK_CTL_KILL;
-    } while (clkReg[PCMCLK].ctrl & CLK_CTL_BUSY);
-  }
-  fprintf(stderr, "PCM clock stopped, changing source to PLLD\n");
+  stopClock(PCMCLK, "PCMCLK");
+  LOG_INFO("PCM clock stopped, changing source to PLLD\n");
   // set PCM Clock to PLLD
   clkReg[PCMCLK].ctrl = BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLD) | CLK_CTL_ENAB;
   // get frequency of PLLD
@@ -158,15 +180,108 @@ void Clock::initClock() {
   pllPer = clkReg[PLLD_PER].ctrl;
   frequency = ((XOSC_FREQUENCY * ((uint64_t)pllCtl & 0x3ff) + (XOSC_FREQUENCY * (uint64_t)pllFrac) / (1 << 20)) /
                (2 * pllPer >> 1)) / ((pllCtl >> 12) & 0x7) * 2;
-  fprintf(stderr, "PLL D frequency %lu\n", frequency);
+  LOG_DEBUG("PLL D frequency %lu\n", frequency);
   plldFrequency = frequency;
-  sleep(1.0);
   // check for frequency lock
-  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKD > 0) {
-    fprintf(stderr, "PLLD clock has locked into its frequency of %lu Hz.\n", plldFrequency);
+  if (waitForRegister(&clkReg[CM_LOCK].div, CM_LOCK_FLOCKD, CM_LOCK_FLOCKD, CM_LOCK_TIMEOUT, "PLLD lock")) {
+    LOG_INFO("PLLD clock has locked into its frequency of %lu Hz.\n", plldFrequency);
   } else {
-    fprintf(stderr, "PLLD clock has failed to lock into its frequency of %lu Hz.\n", plldFrequency);
+    LOG_WARN("PLLD clock has failed to lock into its frequency of %lu Hz.\n", plldFrequency);
   }
+  endPhase("PCM clock to PLLD and PLLD lock");
+}
+
+// turn off enable and send kill - turning off enable doesn't seem to be enough
+void Clock::stopClock(uint32_t clock, const char * name) {
+  uint32_t clockControlCopy = clkReg[clock].ctrl;
+  if (clockControlCopy & CLK_CTL_BUSY) {
+    LOG_DEBUG("%s is busy\n", name);
+    LOG_DEBUG("Sending %s control %8.8x\n", name,
+              BCM_PASSWD | (clockControlCopy & ~CLK_CTL_ENAB & 0xffffff) | CLK_CTL_KILL);
+    clkReg[clock].ctrl = BCM_PASSWD | (clockControlCopy & ~CLK_CTL_ENAB & 0xffffff) | CLK_CTL_KILL;
+    if (waitForRegister(&clkReg[clock].ctrl, CLK_CTL_BUSY, 0, CLK_CTL_BUSY_TIMEOUT, name)) {
+      LOG_DEBUG("%s has stopped\n", name);
+    }
+  }
+}
+
+bool Clock::waitForRegister(volatile uint32_t * reg, uint32_t mask, uint32_t value, double timeout,
+                            const char * what) {
+  struct timespec start;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    if ((*reg & mask) == value) return true;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9 < timeout);
+  LOG_WARN("%s timed out after %.1f ms, register is %8.8x\n", what, timeout * 1000.0, *reg);
+  return false;
+}
+
+void Clock::endPhase(const char * name) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  Phase phase = { name, (now.tv_sec - phaseStart.tv_sec) + (now.tv_nsec - phaseStart.tv_nsec) / 1e9 };
+  phases.push_back(phase);
+  phaseStart = now;
+}
+
+void Clock::reportPhases() {
+  double total = 0.0;
+  LOG_INFO("Startup timing:\n");
+  for (Phase & phase : phases) {
+    LOG_INFO("  %-36s %8.3f ms\n", phase.name, phase.seconds * 1000.0);
+    total += phase.seconds;
+  }
+  LOG_INFO("  %-36s %8.3f ms\n", "total", total * 1000.0);
+}
+
+// Start another output on the clock of a GP1 or GP2 capable pin.  It shares PLLC with GP0, so its frequency is
+// whatever fractional divider of PLLC comes closest.  MASH 1 dithers between the two nearest integer dividers.
+double Clock::startOutput(GPIO * gpio, uint32_t frequency) {
+  const char * names[] = { "GP0CLK", "GP1CLK", "GP2CLK" };
+  if (gpio->gpclk < 1) {
+    LOG_ERROR("GPIO %d is not a GP1 or GP2 clock output - GP0 is reserved for the primary output\n", gpio->pin);
+    exit(-1);
+  }
+  uint32_t clock = GP0CLK + gpio->gpclk;
+  double pllc = plan.actualFrequency * plan.divider;
+  double divisor = pllc / frequency;
+  uint32_t divi = divisor;
+  uint32_t divf = (divisor - divi) * 4096.0 + 0.5;
+  if (divf == 4096) {
+    divi++;
+    divf = 0;
+  }
+  if (divi < 2 || divi > 4095) {
+    LOG_ERROR("%d Hz can't be divided from PLLC at %.0f Hz\n", frequency, pllc);
+    exit(-1);
+  }
+  stopClock(clock, names[gpio->gpclk]);
+  uint32_t control = BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLC) | CLK_CTL_MASH(divf ? 1 : 0);
+  clkReg[clock].ctrl = control;
+  clkReg[clock].div = BCM_PASSWD | CLK_DIV_DIVI(divi) | CLK_DIV_DIVF(divf);
+  clkReg[clock].ctrl = control | CLK_CTL_ENAB;
+  waitForRegister(&clkReg[clock].ctrl, CLK_CTL_BUSY, CLK_CTL_BUSY, CLK_CTL_BUSY_TIMEOUT, names[gpio->gpclk]);
+  outputClocks.push_back(clock);
+  double actualFrequency = pllc / (divi + divf / 4096.0);
+  LOG_INFO("%10d Hz: %s divider %4d + %4d/4096 from PLLC, actual %.3f Hz (error %+.3f Hz)\n", frequency,
+           names[gpio->gpclk], divi, divf, actualFrequency, actualFrequency - frequency);
+  return actualFrequency;
+}
+
+// retune a running clock - GP0 is stopped while its divider is changed, everything else is left alone
+void Clock::setFrequency(uint32_t centerFrequency) {
+  if (centerFrequency == this->centerFrequency) {
+    return;
+  }
+  LOG_INFO("Retuning from %d Hz to %d Hz\n", this->centerFrequency, centerFrequency);
+  this->centerFrequency = centerFrequency;
+  phases.clear();
+  clock_gettime(CLOCK_MONOTONIC, &phaseStart);
+  clkReg[GP0CLK].ctrl = BCM_PASSWD | (gp0ControlCopy & ~0x3f) | CLK_CTL_SRC(CLK_CTL_SRC_PLLC);
+  waitForRegister(&clkReg[GP0CLK].ctrl, CLK_CTL_BUSY, 0, CLK_CTL_BUSY_TIMEOUT, "GP0 clock stop");
+  tuneClock();
 }
 
 Clock::Clock(uint32_t centerFrequency, GPIO * gpio, Peripheral * peripheralUtil) {  // may not need gpio object
@@ -174,22 +289,25 @@ Clock::Clock(uint32_t centerFrequency, GPIO * gpio, Peripheral * peripheralUtil)
   clkReg = reinterpret_cast<CLKCtrlReg *>(cmBasePtr);
   this->gpio = gpio;  // may not need this
   this->centerFrequency = centerFrequency;
+  clock_gettime(CLOCK_MONOTONIC, &phaseStart);
   initClock();
-  fprintf(stderr,
-          "Clock initialization complete, all clocks (GP0, PLLC, PLLD, PCM) should be configured and running\n");
+  LOG_INFO("Clock initialization complete, all clocks (GP0, PLLC, PLLD, PCM) should be configured and running\n");
 }
 
 Clock::~Clock() {
   // before shutdown - look at lock
-  fprintf(stderr, "Clock shutting down\n");
-  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKC > 0) {
-    fprintf(stderr, "PLLC clock is locked into its frequency of %lu Hz.\n", pllcFrequency);
+  LOG_INFO("Clock shutting down\n");
+  for (uint32_t clock : outputClocks) {
+    stopClock(clock, "output clock");
+  }
+  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKC) {
+    LOG_INFO("PLLC clock is locked into its frequency of %lu Hz.\n", pllcFrequency);
   } else {
-    fprintf(stderr, "PLLC clock is not locked into its frequency of %lu Hz.\n", pllcFrequency);
+    LOG_WARN("PLLC clock is not locked into its frequency of %lu Hz.\n", pllcFrequency);
   }
-  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKD > 0) {
-    fprintf(stderr, "PLLD clock is locked into its frequency of %lu Hz.\n", plldFrequency);
+  if (clkReg[CM_LOCK].div & CM_LOCK_FLOCKD) {
+    LOG_INFO("PLLD clock is locked into its frequency of %lu Hz.\n", plldFrequency);
   } else {
-    fprintf(stderr, "PLLD clock is not locked into its frequency of %lu Hz.\n", plldFrequency);
+    LOG_WARN("PLLD clock is not locked into its frequency of %lu Hz.\n", plldFrequency);
   }
 }
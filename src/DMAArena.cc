@@ -0,0 +1,155 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+DMA memory arena
+
+Mark Broihier 2021
+*/
+
+#include "../include/DMAArena.h"
+
+uint32_t DMAArena::addBlock(size_t size) {
+  if (mailboxFD < 0) {
+    mailboxFD = hw->mboxOpen();
+    if (mailboxFD < 0) {
+      LOG_ERROR("Failed to open the mailbox\n");
+      exit(-1);
+    }
+  }
+  Block block;
+  block.size = ((size + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+  block.mbHandle = hw->memAlloc(mailboxFD, block.size, PAGE_SIZE, MEM_FLAG_L1_NONALLOCATING);
+  if (block.mbHandle == 0) {
+    LOG_ERROR("Mailbox allocation of %d bytes failed\n", block.size);
+    exit(-1);
+  }
+  block.busAddr = hw->memLock(mailboxFD, block.mbHandle);
+  block.virtualAddr = hw->mapMem(BUS_TO_PHYS(block.busAddr), block.size);
+  block.freeSpace[0] = block.size;
+  blocks.push_back(block);
+  mailboxAllocations++;
+  LOG_DEBUG("MBox alloc: %d bytes, bus: %08X, virt: %p\n", block.size, block.busAddr, block.virtualAddr);
+  return blocks.size() - 1;
+}
+
+// first fit
+bool DMAArena::allocateFromBlock(uint32_t block, uint32_t size, uint32_t align, Allocation * allocation) {
+  std::map<uint32_t, uint32_t> & freeSpace = blocks[block].freeSpace;
+  for (auto space = freeSpace.begin(); space != freeSpace.end(); space++) {
+    uint32_t start = (space->first + align - 1) / align * align;
+    uint32_t spaceEnd = space->first + space->second;
+    if (start + size > spaceEnd) continue;
+    uint32_t spaceStart = space->first;
+    freeSpace.erase(space);
+    if (start > spaceStart) freeSpace[spaceStart] = start - spaceStart;
+    if (start + size < spaceEnd) freeSpace[start + size] = spaceEnd - (start + size);
+    allocation->virtualAddr = reinterpret_cast<uint8_t *>(blocks[block].virtualAddr) + start;
+    allocation->busAddr = blocks[block].busAddr + start;
+    allocation->size = size;
+    allocation->block = block;
+    return true;
+  }
+  return false;
+}
+
+void DMAArena::allocate(size_t size, uint32_t align, Allocation * allocation) {
+  size = (size + align - 1) / align * align;
+  bool allocated = false;
+  for (uint32_t block = 0; !allocated && block < blocks.size(); block++) {
+    allocated = allocateFromBlock(block, size, align, allocation);
+  }
+  if (!allocated) {
+    allocateFromBlock(addBlock(size > blockSize ? size : blockSize), size, align, allocation);
+  }
+  bytesInUse += size;
+  if (bytesInUse > highWater) highWater = bytesInUse;
+}
+
+void DMAArena::release(Allocation * allocation) {
+  if (allocation->virtualAddr == NULL) return;
+  std::map<uint32_t, uint32_t> & freeSpace = blocks[allocation->block].freeSpace;
+  uint32_t start = allocation->busAddr - blocks[allocation->block].busAddr;
+  uint32_t size = allocation->size;
+  // coalesce with the free space on either side
+  auto next = freeSpace.lower_bound(start);
+  if (next != freeSpace.end() && next->first == start + size) {
+    size += next->second;
+    freeSpace.erase(next);
+  }
+  auto previous = freeSpace.lower_bound(start);
+  if (previous != freeSpace.begin()) {
+    previous--;
+    if (previous->first + previous->second == start) {
+      start = previous->first;
+      size += previous->second;
+      freeSpace.erase(previous);
+    }
+  }
+  freeSpace[start] = size;
+  bytesInUse -= allocation->size;
+  allocation->virtualAddr = NULL;
+}
+
+size_t DMAArena::getMailboxBytes() {
+  size_t bytes = 0;
+  for (Block & block : blocks) {
+    bytes += block.size;
+  }
+  return bytes;
+}
+
+// free space in the blocks held, in total and the largest single piece
+void DMAArena::getFreeSpace(size_t * total, size_t * largest) {
+  *total = 0;
+  *largest = 0;
+  for (Block & block : blocks) {
+    for (auto & piece : block.freeSpace) {
+      *total += piece.second;
+      if (piece.second > *largest) *largest = piece.second;
+    }
+  }
+}
+
+DMAArena::DMAArena(Peripheral * peripheralUtil, uint32_t blockSize) {
+  hw = peripheralUtil->backend();
+  mailboxFD = -1;
+  this->blockSize = blockSize;
+  bytesInUse = 0;
+  highWater = 0;
+  mailboxAllocations = 0;
+}
+
+DMAArena::~DMAArena() {
+  LOG_INFO("DMA arena: %d mailbox blocks (%d bytes), high water %d bytes\n", mailboxAllocations,
+           static_cast<uint32_t>(getMailboxBytes()), static_cast<uint32_t>(highWater));
+  for (Block & block : blocks) {
+    hw->unmapMem(block.virtualAddr, block.size);
+    hw->memUnlock(mailboxFD, block.mbHandle);
+    hw->memFree(mailboxFD, block.mbHandle);
+  }
+  if (mailboxFD >= 0) hw->mboxClose(mailboxFD);
+}
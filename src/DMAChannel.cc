@@ -31,121 +31,1045 @@ Mark Broihier 2021
 */
 #include "../include/DMAChannel.h"
 
-DMAChannel::DMAMemHandle * DMAChannel::dmaMalloc(size_t size) {
-  if (mailboxFD < 0) {
-    mailboxFD = mbox_open();
-    assert(mailboxFD >= 0);
+static double secondsSince(const struct timespec & start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// control blocks and constants are sub-allocated from the channel's arena - only a new high water mark costs
+// mailbox calls
+DMAChannel::DMAMemHandle * DMAChannel::dmaMalloc(size_t size, uint32_t align) {
+  DMAMemHandle *mem = reinterpret_cast<DMAMemHandle *>(malloc(sizeof(DMAMemHandle)));
+  arena->allocate(size, align, mem);
+  return mem;
+}
+
+void DMAChannel::dmaFree(DMAMemHandle *mem) {
+  arena->release(mem);
+}
+
+// count the runs of identical subsymbols - each run becomes one key control block and one delay control block
+size_t DMAChannel::countRuns(char * subSymbols, size_t subSymbolsSize) {
+  size_t runs = 0;
+  for (size_t index = 0; index < subSymbolsSize; index++) {
+    if (index == 0 || subSymbols[index] != subSymbols[index - 1]) {
+      runs++;
+    }
   }
+  return runs;
+}
 
-  // Make `size` a multiple of PAGE_SIZE
-  size = ((size + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+void DMAChannel::dmaAllocBuffers(GPIO * gpio) {
+  dmaCBs = 0;
+  glyphCBs = 0;
+  keyRegister = PERI_BUS_BASE + GPIO_BASE + gpio->fselOffset();
+  keyedPins.push_back(gpio->pin);
+  commandPinToClock = dmaMalloc(sizeof(uint32_t), sizeof(uint32_t));
+  *reinterpret_cast<uint32_t *>(commandPinToClock->virtualAddr) = gpio->keyWord(gpio->pinModeSettings, true);
+  commandPinToInput = dmaMalloc(sizeof(uint32_t), sizeof(uint32_t));
+  *reinterpret_cast<uint32_t *>(commandPinToInput->virtualAddr) = gpio->keyWord(gpio->pinModeSettings, false);
+  addAbortPin(gpio);
+}
 
-  DMAMemHandle *mem = reinterpret_cast<DMAMemHandle *>(malloc(sizeof(DMAMemHandle)));
-  // Documentation: https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
-  mem->mbHandle = mem_alloc(mailboxFD, size, PAGE_SIZE, MEM_FLAG_L1_NONALLOCATING);
-  mem->busAddr = mem_lock(mailboxFD, mem->mbHandle);
-  mem->virtualAddr = mapmem(BUS_TO_PHYS(mem->busAddr), size);
-  mem->size = size;
+// adds a pin to the abort terminator - the key up word of its function select register is kept in the padding of
+// that register's control block, the way a register write control block keeps its value
+void DMAChannel::addAbortPin(GPIO * gpio) {
+  if (!abortCBs) {
+    abortCBs = dmaMalloc(ABORT_REGISTERS_MAXIMUM * sizeof(DMAControlBlock));
+  }
+  DMAControlBlock * cbs = reinterpret_cast<DMAControlBlock *>(abortCBs->virtualAddr);
+  int index = 0;
+  while (index < abortRegisters && abortOffsets[index] != gpio->fselOffset()) index++;
+  if (index == ABORT_REGISTERS_MAXIMUM) {
+    LOG_ERROR("Too many function select registers to key up on an abort\n");
+    exit(-1);
+  }
+  if (index == abortRegisters) {
+    uint32_t cbAddr = abortCBs->busAddr + index * sizeof(DMAControlBlock);
+    cbs[index].txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+    cbs[index].src = cbAddr + offsetof(DMAControlBlock, padding);
+    cbs[index].dest = PERI_BUS_BASE + GPIO_BASE + gpio->fselOffset();
+    cbs[index].txLen = 4;
+    cbs[index].stride = 0;
+    cbs[index].nextCB = 0;
+    cbs[index].padding[0] = gpio->pinModeSettings;
+    cbs[index].padding[1] = 0;
+    if (index > 0) cbs[index - 1].nextCB = cbAddr;
+    abortOffsets[index] = gpio->fselOffset();
+    abortMasks[index] = 0;
+    abortRegisters++;
+  }
+  cbs[index].padding[0] = gpio->keyWord(cbs[index].padding[0], false);
+  abortMasks[index] |= 7 << gpio->fselShift();
+}
+
+// Control block memory is kept between messages and grows by whole chunks when a larger program is needed.  One
+// more control block than asked for is kept, so the one after the last always has an address.
+void DMAChannel::allocCBs(CBStorage ** storage, size_t controlBlocks) {
+  controlBlocks++;
+  if (!*storage) {
+    *storage = new CBStorage();
+    (*storage)->capacity = 0;
+  }
+  CBStorage * cbs = *storage;
+  if (controlBlocks <= cbs->capacity) {
+    return;
+  }
+  if (cbs->chunks.size() == 1 && cbs->capacity < CHUNK_CBS) {  // a chunk of its own size is replaced
+    dmaFree(cbs->chunks[0]);
+    free(cbs->chunks[0]);
+    cbs->chunks.clear();
+    cbs->capacity = 0;
+  }
+  if (controlBlocks < CHUNK_CBS && cbs->chunks.empty()) {
+    cbs->chunks.push_back(dmaMalloc(controlBlocks * sizeof(DMAControlBlock)));
+    cbs->capacity = controlBlocks;
+    return;
+  }
+  while (cbs->capacity < controlBlocks) {
+    cbs->chunks.push_back(dmaMalloc(CHUNK_CBS * sizeof(DMAControlBlock)));
+    cbs->capacity += CHUNK_CBS;
+  }
+}
 
-  assert(mem->busAddr != 0);
+void DMAChannel::dmaAllocCBs(size_t controlBlocks) {
+  allocCBs(&dmaCBs, controlBlocks);
+}
 
-  fprintf(stderr, "MBox alloc: %d bytes, bus: %08X, virt: %08X\n", mem->size, mem->busAddr,
-          (uint32_t)mem->virtualAddr);
+void DMAChannel::dmaFreeCBs(CBStorage * storage) {
+  for (DMAMemHandle * chunk : storage->chunks) {
+    dmaFree(chunk);
+    free(chunk);
+  }
+  delete storage;
+}
 
-  return mem;
+int DMAChannel::cbIndex(CBStorage * storage, uint32_t busAddr) {
+  if (!storage) return -1;
+  for (size_t chunk = 0; chunk < storage->chunks.size(); chunk++) {
+    DMAMemHandle * memory = storage->chunks[chunk];
+    if (busAddr >= memory->busAddr && busAddr < memory->busAddr + memory->size) {
+      return chunk * CHUNK_CBS + (busAddr - memory->busAddr) / sizeof(DMAControlBlock);
+    }
+  }
+  return -1;
 }
 
-void DMAChannel::dmaFree(DMAMemHandle *mem) {
-  if (mem->virtualAddr == NULL) return;
+// how full the program's chunks are, and how broken up the arena's free space is
+void DMAChannel::reportStorage() {
+  size_t freeBytes;
+  size_t largestFree;
+  arena->getFreeSpace(&freeBytes, &largestFree);
+  LOG_INFO("CB storage: %d chunks, %d of %d control blocks used (%.1f%%); arena: %d mailbox blocks (%d bytes), "
+           "%d bytes free, largest free piece %d bytes (fragmentation %.1f%%)\n",
+           static_cast<uint32_t>(dmaCBs->chunks.size()), cbCount, static_cast<uint32_t>(dmaCBs->capacity),
+           100.0 * cbCount / dmaCBs->capacity, arena->getMailboxAllocations(),
+           static_cast<uint32_t>(arena->getMailboxBytes()), static_cast<uint32_t>(freeBytes),
+           static_cast<uint32_t>(largestFree), freeBytes ? 100.0 * (1.0 - 1.0 * largestFree / freeBytes) : 0.0);
+}
 
-  unmapmem(mem->virtualAddr, PAGE_SIZE);
-  mem_unlock(mailboxFD, mem->mbHandle);
-  mem_free(mailboxFD, mem->mbHandle);
-  mem->virtualAddr = NULL;
+// key control block - send the clock to the pin (key down) or set the pin to input (key up)
+void DMAChannel::setKeyCB(DMAControlBlock * cb, bool keyDown, uint32_t nextCB) {
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+  cb->src = keyDown ? commandPinToClockBusAddr() : commandPinToInputBusAddr();
+  cb->dest = keyRegister;
+  cb->txLen = 4;
+  cb->stride = 0;
+  cb->nextCB = nextCB;
+}
+
+// delay control block - each word written to the PCM FIFO waits for one PCM clock (DREQ)
+void DMAChannel::setDelayCB(DMAControlBlock * cb, uint32_t ticks, uint32_t nextCB) {
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(PCM_TX);
+  cb->src = commandPinToInputBusAddr();  // Dummy data
+  cb->dest = PERI_BUS_BASE + PCM_BASE + PCM_FIFO;
+  cb->txLen = 4 * ticks;
+  cb->stride = 0;
+  cb->nextCB = nextCB;
+}
+
+void DMAChannel::initKeyCB(CBStorage * storage, int index, bool keyDown, int nextIndex) {
+  setKeyCB(cbVirtAddr(storage, index), keyDown, cbBusAddr(storage, nextIndex < 0 ? index + 1 : nextIndex));
 }
 
-void DMAChannel::dmaAllocBuffers(size_t subSymbolsSize, uint32_t clocksPerSubSymbol, GPIO * gpio) {
-  dmaCBs = dmaMalloc((PCM_FIFO_SIZE + 2 * subSymbolsSize * clocksPerSubSymbol + 1) * sizeof(DMAControlBlock));
-  commandPinToClock = dmaMalloc(sizeof(uint32_t));
-  // note, this only works for the first 10 BCM GPIO pins
-  *reinterpret_cast<uint32_t *>(commandPinToClock->virtualAddr) = (gpio->pinModeSettings & ~(7 << (gpio->pin * 3))) |
-    (4 << (gpio->pin * 3));
-  commandPinToInput = dmaMalloc(sizeof(uint32_t));
-  *reinterpret_cast<uint32_t *>(commandPinToInput->virtualAddr) = gpio->pinModeSettings & ~(7 << (gpio->pin * 3));
+void DMAChannel::initDelayCB(CBStorage * storage, int index, uint32_t ticks, int nextIndex) {
+  setDelayCB(cbVirtAddr(storage, index), ticks, cbBusAddr(storage, nextIndex < 0 ? index + 1 : nextIndex));
+}
+
+void DMAChannel::initKeyCB(int index, bool keyDown, int nextIndex) {
+  initKeyCB(dmaCBs, index, keyDown, nextIndex);
+}
+
+void DMAChannel::initDelayCB(int index, uint32_t ticks, int nextIndex) {
+  initDelayCB(dmaCBs, index, ticks, nextIndex);
+}
+
+// register write control block - the value written is kept in the control block's own padding
+void DMAChannel::initRegisterWriteCB(int index, const RegisterWrite & write) {
+  DMAControlBlock * cb = ithCBVirtAddr(index);
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+  cb->src = ithCBBusAddr(index) + offsetof(DMAControlBlock, padding);
+  cb->dest = PERI_BUS_BASE + write.offset;
+  cb->txLen = 4;
+  cb->stride = 0;
+  cb->nextCB = ithCBBusAddr(index + 1);
+  cb->padding[0] = write.value;
+}
+
+// Each run of identical subsymbols is one key control block followed by one delay control block that covers the
+// whole run.  When the message text is given, a character starts in the run that holds its first subsymbol - runs
+// of spaces can span characters.  Returns the index of the control block after the segment's last run.
+int DMAChannel::compileSegment(Segment * segment, char * subSymbols, uint32_t clocksPerSubSymbol,
+                                const char * message) {
+  size_t subSymbolIndex = segment->begin;
+  size_t characters = message ? strlen(message) : 0;
+  size_t character = segment->character;
+  size_t characterStart = segment->characterStart;
+  int index = segment->index;
+  while (subSymbolIndex < segment->end) {
+    size_t runLength = 1;
+    while (subSymbolIndex + runLength < segment->end &&
+           subSymbols[subSymbolIndex + runLength] == subSymbols[subSymbolIndex]) {
+      runLength++;
+    }
+    while (character < characters && characterStart < subSymbolIndex + runLength) {
+      CharacterStart start = { static_cast<uint32_t>(index),
+                               static_cast<uint32_t>(characterStart * clocksPerSubSymbol) };
+      segment->starts.push_back(start);
+      characterStart += MorseEncoder::packedGlyph(message[character++]).length;
+    }
+    initKeyCB(segment->storage, index++, subSymbols[subSymbolIndex]);
+    initDelayCB(segment->storage, index++, runLength * clocksPerSubSymbol);
+    subSymbolIndex += runLength;
+  }
+  return index;
+}
+
+// Long messages are compiled on every core.  The message is cut into segments at run boundaries, so no run is
+// split and the control block count is the same; a walk of the characters' lengths (a prefix sum) finds the first
+// character of each segment, and a prefix sum of the segments' run counts gives each its first control block.
+// Each control block links to the one after it, so the ranges join up without fixing links.  Character starts are
+// appended to starts when it is given.  Returns the index of the control block after the last run.
+int DMAChannel::compileRuns(CBStorage * storage, int index, char * subSymbols, size_t subSymbolsSize,
+                            uint32_t clocksPerSubSymbol, const char * message, std::vector<CharacterStart> * starts) {
+  size_t segmentCount = subSymbolsSize < PARALLEL_MINIMUM_SUBSYMBOLS ? 1 : compileThreads;
+  std::vector<Segment> segments;
+  size_t characters = message ? strlen(message) : 0;
+  size_t character = 0;
+  size_t characterStart = 0;
+  size_t begin = 0;
+  for (size_t part = 1; part <= segmentCount && begin < subSymbolsSize; part++) {
+    size_t end = std::max(begin + 1, subSymbolsSize * part / segmentCount);
+    while (end < subSymbolsSize && subSymbols[end] == subSymbols[end - 1]) {
+      end++;
+    }
+    while (character < characters && characterStart < begin) {
+      characterStart += MorseEncoder::packedGlyph(message[character++]).length;
+    }
+    Segment segment = { storage, begin, end, character, characterStart, 0, std::vector<CharacterStart>() };
+    segments.push_back(segment);
+    begin = end;
+  }
+  if (segments.size() <= 1) {
+    if (segments.empty()) return index;
+    segments[0].index = index;
+    index = compileSegment(&segments[0], subSymbols, clocksPerSubSymbol, message);
+    if (starts) starts->insert(starts->end(), segments[0].starts.begin(), segments[0].starts.end());
+    return index;
+  }
+  std::vector<size_t> runs(segments.size());
+  std::vector<std::thread> workers;
+  for (size_t part = 0; part < segments.size(); part++) {
+    workers.push_back(std::thread([&, part] {
+      runs[part] = countRuns(subSymbols + segments[part].begin, segments[part].end - segments[part].begin);
+    }));
+  }
+  for (std::thread & worker : workers) worker.join();
+  workers.clear();
+  for (Segment & segment : segments) {
+    segment.index = index;
+    index += 2 * runs[&segment - segments.data()];
+  }
+  for (Segment & segment : segments) {
+    workers.push_back(std::thread(&DMAChannel::compileSegment, this, &segment, subSymbols, clocksPerSubSymbol,
+                                  message));
+  }
+  for (std::thread & worker : workers) worker.join();
+  for (Segment & segment : segments) {
+    if (starts) starts->insert(starts->end(), segment.starts.begin(), segment.starts.end());
+  }
+  return index;
 }
-void DMAChannel::dmaInitCBs(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol) {
+
+// A whole program in the given storage: the FIFO fill, the runs and a control block that stops the key and the
+// DMA.  Returns the number of control blocks.
+int DMAChannel::compileProgram(CBStorage * storage, char * subSymbols, size_t subSymbolsSize,
+                               uint32_t clocksPerSubSymbol, const char * message,
+                               std::vector<CharacterStart> * starts) {
   DMAControlBlock *cb;
   int index = 0;
-  cb = ithCBVirtAddr(index);  // point to first control block - this is always used to fill the FIFO before
-                              // transmission
+  cb = cbVirtAddr(storage, index);  // point to first control block - this is always used to fill the FIFO before
+                                    // transmission
   cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(PCM_TX);  // 2
   cb->src = commandPinToInputBusAddr();  // set the pin to input (won't send clock to the pin)
   cb->dest = PERI_BUS_BASE + PCM_BASE + PCM_FIFO;
   cb->txLen = 4 * (PCM_FIFO_SIZE + 1);
   cb->stride = 0;
   index++;
-  cb->nextCB = ithCBBusAddr(index);
-  int subSymbolIndex = 0;
-  int clocks = 0;
-  while (subSymbolIndex < subSymbolsSize) {
-    // signal control block - clock or no clock
+  cb->nextCB = cbBusAddr(storage, index);
+  index = compileRuns(storage, index, subSymbols, subSymbolsSize, clocksPerSubSymbol, message, starts);
+  // stop output of clock and DMA
+  cb = cbVirtAddr(storage, index);
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+  cb->src = commandPinToInputBusAddr();
+  cb->dest = keyRegister;
+  cb->txLen = 4;
+  cb->stride = 0;
+  cb->nextCB = 0;  // no more DMA commands
+  return index + 1;
+}
+
+void DMAChannel::dmaInitCBs(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol,
+                            const char * message) {
+  programTicks = subSymbolsSize * clocksPerSubSymbol;
+  characterStarts.clear();
+  glyphProgram = false;
+  looping = false;
+  cbCount = compileProgram(dmaCBs, subSymbols, subSymbolsSize, clocksPerSubSymbol, message, &characterStarts);
+  reportProgram(subSymbolsSize, clocksPerSubSymbol);
+}
+
+void DMAChannel::reportProgram(size_t subSymbolsSize, uint32_t clocksPerSubSymbol) {
+  // report the size of the program against one key and one delay control block per PCM clock
+  uint32_t uncompressedCount = 2 * subSymbolsSize * clocksPerSubSymbol + 2;
+  LOG_INFO("CB program: %d control blocks (%d bytes), uncompressed: %d control blocks (%d bytes)\n",
+           cbCount, static_cast<uint32_t>(cbCount * sizeof(DMAControlBlock)), uncompressedCount,
+           static_cast<uint32_t>(uncompressedCount * sizeof(DMAControlBlock)));
+  reportStorage();
+
+  // decode the control blocks and check the program when debugging
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+    verifyProgram();
+  }
+}
+
+
+// a ring slot is a key control block and a delay control block - the last slot links back to the first
+void DMAChannel::initRingSlot(uint32_t slot, bool keyDown, uint32_t ticks) {
+  uint32_t index = ringSlotIndex(slot);
+  initKeyCB(index, keyDown);
+  initDelayCB(index + 1, ticks, slot == ringSlots - 1 ? ringSlotIndex(0) : index + 2);
+}
+
+void DMAChannel::dmaInitRing(uint32_t idleTicks) {
+  DMAControlBlock *cb = ithCBVirtAddr(0);  // FIFO fill control block
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(PCM_TX);
+  cb->src = commandPinToInputBusAddr();
+  cb->dest = PERI_BUS_BASE + PCM_BASE + PCM_FIFO;
+  cb->txLen = 4 * (PCM_FIFO_SIZE + 1);
+  cb->stride = 0;
+  cb->nextCB = ithCBBusAddr(ringSlotIndex(0));
+  // every slot starts out idle (key up) so the ring can be played before it has been filled
+  for (uint32_t slot = 0; slot < ringSlots; slot++) {
+    initRingSlot(slot, false, idleTicks);
+  }
+  cbCount = 2 * ringSlots + 1;
+  LOG_INFO("CB ring: %d slots, %d control blocks (%d bytes)\n", ringSlots, cbCount,
+           static_cast<uint32_t>(cbCount * sizeof(DMAControlBlock)));
+}
+
+// the slot the DMA engine is playing - the FIFO fill control block counts as the first slot
+uint32_t DMAChannel::ringConsumerSlot() {
+  int index = cbIndex(dmaCBs, dmaReg->cbAddr);
+  if (index < static_cast<int>(ringSlotIndex(0)) || index >= static_cast<int>(cbCount)) {
+    return 0;
+  }
+  return (index - ringSlotIndex(0)) / 2;
+}
+
+// The producer keeps the slots ahead of the DMA engine filled with runs from the source.  Slots the engine has
+// played are returned to idle right away, so if the producer falls behind the ring keys up rather than replaying
+// old runs.  Positions are counted from the start of the stream and reduced modulo the ring size.  A slot is only
+// written two or more slots ahead of the engine, and the engine's position is read again after each write - if
+// it has reached the slot, the run may not have been seen, and that is counted as the ring running dry.
+void DMAChannel::streamProducer(SubSymbolSource source, void * context, uint32_t clocksPerSubSymbol) {
+  const size_t CHUNK_SIZE = 1024;
+  char * chunk = reinterpret_cast<char *>(malloc(CHUNK_SIZE));
+  int chunkSize = 0;
+  int chunkIndex = 0;
+  uint32_t * slotTicks = reinterpret_cast<uint32_t *>(calloc(ringSlots, sizeof(uint32_t)));
+  uint64_t writePosition = 0;  // next slot to fill
+  uint64_t playPosition = 0;   // slot being played
+  uint64_t pendingTicks = 0;   // PCM clocks queued ahead of the slot being played
+  uint64_t minimumMargin = UINT64_MAX;
+  uint32_t dryCount = 0;
+  bool started = false;
+  bool endOfInput = false;
+  bool terminated = false;
+
+  // the slot the engine is playing, as a position from the start of the stream
+  auto enginePosition = [&]() {
+    return playPosition + (ringConsumerSlot() + ringSlots - playPosition % ringSlots) % ringSlots;
+  };
+
+  while (!stopStreaming) {
+    if (started) {
+      uint64_t newPlayPosition = enginePosition();
+      for (; playPosition < newPlayPosition; playPosition++) {
+        uint32_t playedSlot = playPosition % ringSlots;
+        if (playPosition < writePosition) {
+          pendingTicks -= slotTicks[playedSlot];
+        }
+        slotTicks[playedSlot] = 0;
+        initRingSlot(playedSlot, false, clocksPerSubSymbol);
+      }
+      if (!dmaIsActive()) {
+        break;
+      }
+      if (terminated) {
+        usleep(5000);
+        continue;
+      }
+      if (writePosition > playPosition && pendingTicks < minimumMargin) {
+        minimumMargin = pendingTicks;
+      }
+    }
+    // fill free slots - the slot being played and the one after it are never touched
+    while (!endOfInput && writePosition + 1 < playPosition + ringSlots) {
+      if (chunkIndex == chunkSize) {
+        chunkSize = source(chunk, CHUNK_SIZE, context);
+        chunkIndex = 0;
+        if (chunkSize < 0) {
+          endOfInput = true;
+          chunkSize = 0;
+        }
+        if (chunkSize == 0) break;
+      }
+      int runLength = 1;
+      while (chunkIndex + runLength < chunkSize && chunk[chunkIndex + runLength] == chunk[chunkIndex]) {
+        runLength++;
+      }
+      if (started) {
+        uint64_t position = enginePosition();
+        if (writePosition < position + 2) {
+          // the ring ran dry, or is about to - resume two slots ahead of the engine
+          if (writePosition > 0) dryCount++;
+          writePosition = position + 2;
+          pendingTicks = 0;
+          if (writePosition + 1 >= playPosition + ringSlots) break;  // the slots in between aren't idle yet
+        }
+      }
+      uint32_t slot = writePosition % ringSlots;
+      slotTicks[slot] = runLength * clocksPerSubSymbol;
+      initRingSlot(slot, chunk[chunkIndex], slotTicks[slot]);
+      pendingTicks += slotTicks[slot];
+      chunkIndex += runLength;
+      if (started && enginePosition() >= writePosition) {
+        dryCount++;  // the engine got to the slot while it was being written
+      }
+      writePosition++;
+    }
+    if (endOfInput && !terminated && chunkIndex == chunkSize) {
+      if (started && writePosition < enginePosition() + 2) {
+        writePosition = enginePosition() + 2;
+      }
+      // end the program at the next free slot - key up and no next control block
+      uint32_t index = ringSlotIndex(writePosition % ringSlots);
+      initKeyCB(index, false);
+      ithCBVirtAddr(index)->nextCB = 0;
+      terminated = true;
+    }
+    if (!started) {
+      dmaStart();
+      started = true;
+    }
+    usleep(5000);
+  }
+  LOG_INFO("Stream: %llu slots written, minimum refill margin %llu PCM clocks, ring ran dry %d times\n",
+           static_cast<unsigned long long>(writePosition),
+           static_cast<unsigned long long>(minimumMargin == UINT64_MAX ? 0 : minimumMargin), dryCount);
+  free(slotTicks);
+  free(chunk);
+  streaming = false;
+}
+
+void DMAChannel::streamStart(SubSymbolSource source, void * context, uint32_t clocksPerSubSymbol) {
+  dmaInitRing(clocksPerSubSymbol);
+  stopStreaming = false;
+  streaming = true;
+  producer = std::thread(&DMAChannel::streamProducer, this, source, context, clocksPerSubSymbol);
+}
+
+void DMAChannel::streamStop() {
+  stopStreaming = true;
+  if (producer.joinable()) {
+    producer.join();
+  }
+}
+
+// Build a fragment of key/delay control blocks for every character in the translation table.  The fragments
+// are kept for as long as the rate doesn't change.  The next control block of a fragment's last (tail) control
+// block is filled in while the message is played by the link control block that jumps into the fragment.
+void DMAChannel::dmaInitGlyphs(uint32_t clocksPerSubSymbol) {
+  if (glyphCBs && glyphClocksPerSubSymbol == clocksPerSubSymbol) {
+    return;
+  }
+  char pattern[32];
+  size_t controlBlocks = 0;
+  char character;
+  for (uint32_t entry = 0; (character = MorseEncoder::characterAt(entry)) != 0; entry++) {
+    size_t patternSize = MorseEncoder::characterToMorse(character, pattern, sizeof(pattern));
+    controlBlocks += 2 * countRuns(pattern, patternSize);
+  }
+  if (!glyphCBs || controlBlocks * sizeof(DMAControlBlock) > glyphCBs->size) {
+    if (glyphCBs) {
+      dmaFree(glyphCBs);
+      free(glyphCBs);
+    }
+    glyphCBs = dmaMalloc(controlBlocks * sizeof(DMAControlBlock));
+  }
+  DMAControlBlock * glyphs = reinterpret_cast<DMAControlBlock *>(glyphCBs->virtualAddr);
+  for (int glyph = 0; glyph < 256; glyph++) {
+    glyphHead[glyph] = -1;
+  }
+  int index = 0;
+  for (uint32_t entry = 0; (character = MorseEncoder::characterAt(entry)) != 0; entry++) {
+    size_t patternSize = MorseEncoder::characterToMorse(character, pattern, sizeof(pattern));
+    glyphHead[static_cast<uint8_t>(character)] = index;
+    glyphTicks[static_cast<uint8_t>(character)] = patternSize * clocksPerSubSymbol;
+    size_t subSymbolIndex = 0;
+    while (subSymbolIndex < patternSize) {
+      size_t runLength = 1;
+      while (subSymbolIndex + runLength < patternSize &&
+             pattern[subSymbolIndex + runLength] == pattern[subSymbolIndex]) {
+        runLength++;
+      }
+      setKeyCB(&glyphs[index], pattern[subSymbolIndex], glyphCBs->busAddr + (index + 1) * sizeof(DMAControlBlock));
+      index++;
+      setDelayCB(&glyphs[index], runLength * clocksPerSubSymbol,
+                 glyphCBs->busAddr + (index + 1) * sizeof(DMAControlBlock));
+      index++;
+      subSymbolIndex += runLength;
+    }
+    glyphTail[static_cast<uint8_t>(character)] = index - 1;
+    glyphs[index - 1].nextCB = 0;  // set by the link control block that enters this fragment
+    for (int fragment = glyphHead[static_cast<uint8_t>(character)]; fragment < index; fragment++) {
+      glyphs[fragment].padding[1] = index - 1;  // lets progress() find the tail, and from it the character
+    }
+  }
+  glyphClocksPerSubSymbol = clocksPerSubSymbol;
+  LOG_INFO("Glyph cache: %d control blocks (%d bytes) for %d clocks per subsymbol\n", index,
+           static_cast<uint32_t>(index * sizeof(DMAControlBlock)), clocksPerSubSymbol);
+}
+
+// A message is one link control block per character.  The link control block copies the bus address of the
+// following link control block (kept in its own padding) into the tail of the character's fragment and then
+// jumps to the head of the fragment, so fragments can be shared by every occurrence of a character.
+void DMAChannel::loadGlyphMessage(const char * message, uint32_t clocksPerSubSymbol) {
+  dmaInitGlyphs(clocksPerSubSymbol);
+  size_t messageLength = strlen(message);
+  // FIFO fill control block, a link control block per character, and the terminating control block
+  dmaAllocCBs(messageLength + 2);
+  DMAControlBlock *cb = ithCBVirtAddr(0);
+  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(PCM_TX);
+  cb->src = commandPinToInputBusAddr();
+  cb->dest = PERI_BUS_BASE + PCM_BASE + PCM_FIFO;
+  cb->txLen = 4 * (PCM_FIFO_SIZE + 1);
+  cb->stride = 0;
+  cb->nextCB = ithCBBusAddr(1);
+  uint32_t index = 1;
+  programTicks = 0;
+  characterStarts.clear();
+  glyphProgram = true;
+  looping = false;
+  for (size_t characterIndex = 0; characterIndex < messageLength; characterIndex++) {
+    uint8_t glyph = toupper(message[characterIndex]);
+    assert(glyphHead[glyph] >= 0);
+    CharacterStart start = { index, static_cast<uint32_t>(programTicks) };
+    characterStarts.push_back(start);
+    programTicks += glyphTicks[glyph];
     cb = ithCBVirtAddr(index);
     cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
-    cb->src = subSymbols[subSymbolIndex] ? commandPinToClockBusAddr() : commandPinToInputBusAddr();
-    cb->dest = PERI_BUS_BASE + GPIO_BASE + GPIO_FSEL;
-    cb->txLen = 4;
-    cb->stride = 0;
-    index++;
-    cb->nextCB = ithCBBusAddr(index);
-    // delay control block - one subsymbol clock
-    cb = ithCBVirtAddr(index);
-    cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(PCM_TX);
-    cb->src = ithCBBusAddr(0);  // Dummy data
-    cb->dest = PERI_BUS_BASE + PCM_BASE + PCM_FIFO;
+    cb->src = ithCBBusAddr(index) + offsetof(DMAControlBlock, padding);
+    cb->dest = glyphCBs->busAddr + glyphTail[glyph] * sizeof(DMAControlBlock) + offsetof(DMAControlBlock, nextCB);
     cb->txLen = 4;
     cb->stride = 0;
+    cb->nextCB = glyphCBs->busAddr + glyphHead[glyph] * sizeof(DMAControlBlock);
+    cb->padding[0] = ithCBBusAddr(index + 1);
     index++;
-    cb->nextCB = ithCBBusAddr(index);
-    clocks++;
-    if (clocks == clocksPerSubSymbol) {
-      subSymbolIndex++;  // go to next sub symbol if we've sent this one out enough times
-      clocks = 0;
+  }
+  // stop output of clock and DMA
+  setKeyCB(ithCBVirtAddr(index), false, 0);
+  cbCount = index + 1;
+  LOG_INFO("CB program: %d link control blocks (%d bytes) for %d characters\n", cbCount,
+           static_cast<uint32_t>(cbCount * sizeof(DMAControlBlock)), static_cast<uint32_t>(messageLength));
+  reportStorage();
+}
+
+void DMAChannel::loadMessage(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol,
+                             const char * message) {
+  // FIFO fill control block, a key and a delay control block per run, and the terminating control block
+  dmaAllocCBs(2 * countRuns(subSymbols, subSymbolsSize) + 2);
+  dmaInitCBs(subSymbols, subSymbolsSize, clocksPerSubSymbol, message);
+}
+
+// A beacon is one program that steps through a list of frequencies.  The retune register writes of a step are
+// made while the key is up, between the previous step's message and its own.
+void DMAChannel::loadBeacon(const std::vector<BeaconStep> & steps, uint32_t clocksPerSubSymbol) {
+  // FIFO fill control block, a write and a delay control block per retune write, a key and a delay control
+  // block per run, and the terminating control block
+  size_t controlBlocks = 2;
+  for (const BeaconStep & step : steps) {
+    controlBlocks += 2 * step.retune.size() + 2 * countRuns(step.subSymbols, step.subSymbolsSize);
+  }
+  dmaAllocCBs(controlBlocks);
+  initDelayCB(0, PCM_FIFO_SIZE + 1);
+  int index = 1;
+  programTicks = 0;
+  characterStarts.clear();
+  glyphProgram = false;
+  looping = false;
+  for (const BeaconStep & step : steps) {
+    for (const RegisterWrite & write : step.retune) {
+      initRegisterWriteCB(index++, write);
+      if (write.delayTicks) {
+        initDelayCB(index++, write.delayTicks);
+        programTicks += write.delayTicks;
+      }
     }
+    index = compileRuns(dmaCBs, index, step.subSymbols, step.subSymbolsSize, clocksPerSubSymbol, 0,
+                        &characterStarts);
+    programTicks += step.subSymbolsSize * clocksPerSubSymbol;
   }
   // stop output of clock and DMA
-  cb = ithCBVirtAddr(index);
-  cb->txInfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
-  cb->src = commandPinToInputBusAddr();
-  cb->dest = PERI_BUS_BASE + GPIO_BASE + GPIO_FSEL;
-  cb->txLen = 4;
-  cb->stride = 0;
-  cb->nextCB = 0;  // no more DMA commands
+  setKeyCB(ithCBVirtAddr(index), false, 0);
+  cbCount = index + 1;
+  LOG_INFO("CB program: %d control blocks (%d bytes) for a beacon of %d steps\n", cbCount,
+           static_cast<uint32_t>(cbCount * sizeof(DMAControlBlock)), static_cast<uint32_t>(steps.size()));
+  reportStorage();
+}
+
+// Several outputs are keyed by one program so that one PCM FIFO paces all of them.  The runs of every output are
+// merged into one timeline: wherever any output changes, the function select registers that hold the outputs are
+// written with the key state of all of their outputs, and a delay control block runs to the next change.
+void DMAChannel::loadOutputs(const std::vector<Output> & outputs, uint32_t clocksPerSubSymbol) {
+  // key up words of the function select registers that hold outputs - every output pin in them set to input
+  std::map<uint32_t, uint32_t> keyUpWords;
+  for (const Output & output : outputs) {
+    if (std::find(keyedPins.begin(), keyedPins.end(), output.gpio->pin) == keyedPins.end()) {
+      keyedPins.push_back(output.gpio->pin);
+      addAbortPin(output.gpio);
+    }
+    auto word = keyUpWords.find(output.gpio->fselOffset());
+    uint32_t settings = word == keyUpWords.end() ? output.gpio->pinModeSettings : word->second;
+    keyUpWords[output.gpio->fselOffset()] = output.gpio->keyWord(settings, false);
+  }
+  // subsymbol positions where any output changes
+  std::vector<size_t> changes;
+  size_t longest = 0;
+  for (const Output & output : outputs) {
+    for (size_t index = 0; index <= output.subSymbolsSize; index++) {
+      if (index == 0 || index == output.subSymbolsSize || output.subSymbols[index] != output.subSymbols[index - 1]) {
+        changes.push_back(index);
+      }
+    }
+    if (output.subSymbolsSize > longest) longest = output.subSymbolsSize;
+  }
+  std::sort(changes.begin(), changes.end());
+  changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+  // FIFO fill control block, a write per register and a delay control block per change, and the key up writes
+  dmaAllocCBs(1 + changes.size() * (keyUpWords.size() + 1) + keyUpWords.size());
+  initDelayCB(0, PCM_FIFO_SIZE + 1);
+  int index = 1;
+  programTicks = longest * clocksPerSubSymbol;
+  characterStarts.clear();
+  glyphProgram = false;
+  looping = false;
+  std::map<uint32_t, uint32_t> written;
+  for (size_t change = 0; change + 1 < changes.size(); change++) {
+    size_t position = changes[change];
+    std::map<uint32_t, uint32_t> words = keyUpWords;
+    for (const Output & output : outputs) {
+      if (position < output.subSymbolsSize && output.subSymbols[position]) {
+        words[output.gpio->fselOffset()] = output.gpio->keyWord(words[output.gpio->fselOffset()], true);
+      }
+    }
+    for (auto & word : words) {
+      auto last = written.find(word.first);
+      if (last == written.end() || last->second != word.second) {
+        RegisterWrite write = { GPIO_BASE + word.first, word.second, 0 };
+        initRegisterWriteCB(index++, write);
+        written[word.first] = word.second;
+      }
+    }
+    initDelayCB(index++, (changes[change + 1] - position) * clocksPerSubSymbol);
+  }
+  // stop output of every clock and DMA
+  for (auto & word : keyUpWords) {
+    RegisterWrite write = { GPIO_BASE + word.first, word.second, 0 };
+    initRegisterWriteCB(index++, write);
+  }
+  ithCBVirtAddr(index - 1)->nextCB = 0;
+  cbCount = index;
+  LOG_INFO("CB program: %d control blocks (%d bytes) for %d outputs\n", cbCount,
+           static_cast<uint32_t>(cbCount * sizeof(DMAControlBlock)), static_cast<uint32_t>(outputs.size()));
+  reportStorage();
+}
+
+bool DMAChannel::relativeAddress(uint32_t busAddr, uint32_t * kind, uint32_t * relative) {
+  *relative = 0;
+  int index = cbIndex(dmaCBs, busAddr);
+  if (index >= 0 && index < static_cast<int>(cbCount)) {
+    *kind = PROGRAM_OFFSET;
+    *relative = index * sizeof(DMAControlBlock) + busAddr - ithCBBusAddr(index);
+  } else if (busAddr == commandPinToClockBusAddr()) {
+    *kind = PIN_TO_CLOCK;
+  } else if (busAddr == commandPinToInputBusAddr()) {
+    *kind = PIN_TO_INPUT;
+  } else if (busAddr == 0 || busAddr >= PERI_BUS_BASE) {
+    *kind = ABSOLUTE_ADDRESS;
+    *relative = busAddr;
+  } else {
+    return false;  // in DMA memory outside the program
+  }
+  return true;
+}
+
+// Only programs that stay within their own control blocks (not glyph programs, and before a loop is added) can be
+// cached.
+void DMAChannel::cacheProgram(ProgramCache * cache, const char * description, uint32_t clocksPerSubSymbol) {
+  if (glyphProgram || looping) return;
+  size_t cbBytes = cbCount * sizeof(DMAControlBlock);
+  size_t relocationBytes = (cbCount + 3) & ~3;
+  std::vector<uint8_t> image(sizeof(ProgramImage) + cbBytes + relocationBytes +
+                             characterStarts.size() * sizeof(CharacterStart));
+  ProgramImage * header = reinterpret_cast<ProgramImage *>(image.data());
+  header->cbCount = cbCount;
+  header->characterStarts = characterStarts.size();
+  header->programTicks = programTicks;
+  DMAControlBlock * cbs = reinterpret_cast<DMAControlBlock *>(image.data() + sizeof(ProgramImage));
+  uint8_t * relocations = image.data() + sizeof(ProgramImage) + cbBytes;
+  for (uint32_t first = 0; first < cbCount; first += CHUNK_CBS) {
+    memcpy(&cbs[first], ithCBVirtAddr(first),
+           std::min(cbCount - first, static_cast<uint32_t>(CHUNK_CBS)) * sizeof(DMAControlBlock));
+  }
+  for (uint32_t index = 0; index < cbCount; index++) {
+    uint32_t * fields[3] = { &cbs[index].src, &cbs[index].dest, &cbs[index].nextCB };
+    for (int field = 0; field < 3; field++) {
+      uint32_t kind;
+      if (!relativeAddress(*fields[field], &kind, fields[field])) {
+        LOG_WARN("Program cache: control block %d refers to memory outside the program, not cached\n", index);
+        return;
+      }
+      relocations[index] |= kind << (2 * field);
+    }
+  }
+  memcpy(relocations + relocationBytes, characterStarts.data(), characterStarts.size() * sizeof(CharacterStart));
+  cache->store(ProgramCache::key(description, clocksPerSubSymbol, tickRate, keyedPins[0]), description, image);
+}
+
+// The control blocks are copied into DMA memory a chunk at a time and then their addresses are relocated.
+bool DMAChannel::loadCachedProgram(ProgramCache * cache, const char * description, uint32_t clocksPerSubSymbol) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::vector<uint8_t> image;
+  if (!cache->load(ProgramCache::key(description, clocksPerSubSymbol, tickRate, keyedPins[0]), description,
+                   &image)) {
+    return false;
+  }
+  if (image.size() < sizeof(ProgramImage)) {
+    LOG_WARN("Program cache: the cached program is damaged, compiling\n");
+    return false;
+  }
+  ProgramImage header;
+  memcpy(&header, image.data(), sizeof(header));
+  size_t cbBytes = header.cbCount * sizeof(DMAControlBlock);
+  size_t relocationBytes = (header.cbCount + 3) & ~3;
+  if (header.cbCount == 0 || image.size() != sizeof(ProgramImage) + cbBytes + relocationBytes +
+      header.characterStarts * sizeof(CharacterStart)) {
+    LOG_WARN("Program cache: the cached program is damaged, compiling\n");
+    return false;
+  }
+  dmaAllocCBs(header.cbCount);
+  cbCount = header.cbCount;
+  programTicks = header.programTicks;
+  glyphProgram = false;
+  looping = false;
+  const DMAControlBlock * cbs = reinterpret_cast<const DMAControlBlock *>(image.data() + sizeof(ProgramImage));
+  const uint8_t * relocations = image.data() + sizeof(ProgramImage) + cbBytes;
+  for (uint32_t first = 0; first < cbCount; first += CHUNK_CBS) {
+    memcpy(ithCBVirtAddr(first), &cbs[first],
+           std::min(cbCount - first, static_cast<uint32_t>(CHUNK_CBS)) * sizeof(DMAControlBlock));
+  }
+  for (uint32_t index = 0; index < cbCount; index++) {
+    DMAControlBlock * cb = ithCBVirtAddr(index);
+    uint32_t * fields[3] = { &cb->src, &cb->dest, &cb->nextCB };
+    for (int field = 0; field < 3; field++) {
+      switch ((relocations[index] >> (2 * field)) & 3) {
+        case PROGRAM_OFFSET:
+          *fields[field] = ithCBBusAddr(*fields[field] / sizeof(DMAControlBlock)) +
+            *fields[field] % sizeof(DMAControlBlock);
+          break;
+        case PIN_TO_CLOCK:
+          *fields[field] = commandPinToClockBusAddr();
+          break;
+        case PIN_TO_INPUT:
+          *fields[field] = commandPinToInputBusAddr();
+          break;
+        default:
+          break;
+      }
+    }
+  }
+  characterStarts.resize(header.characterStarts);
+  memcpy(characterStarts.data(), relocations + relocationBytes, header.characterStarts * sizeof(CharacterStart));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  LOG_INFO("CB program: %d control blocks (%d bytes) loaded from the program cache in %.1f microseconds\n", cbCount,
+           static_cast<uint32_t>(cbBytes), (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+  reportStorage();
+  return true;
+}
 
-  // print out control blocks
-  /* but only if debugging
-  index = 0;
-  cb = ithCBVirtAddr(index);
-  bool notDone = true;
-  do {
-    fprintf(stderr, "%p TXINFO %8.8x index %5d\n", &cb->txInfo, cb->txInfo, index);
-    fprintf(stderr, "%p SRC    %8.8x\n", &cb->src, cb->src);
-    fprintf(stderr, "%p DEST   %8.8x\n", &cb->dest, cb->dest);
-    fprintf(stderr, "%p LEN    %8.8x\n", &cb->txLen, cb->txLen);
-    fprintf(stderr, "%p NEXT   %8.8x\n", &cb->nextCB, cb->nextCB);
-    if (cb->nextCB == 0) {
-      notDone = false;
+// The terminating control block of the loaded program (every program ends with one, and starts over from control
+// block 1 after the FIFO fill) is linked to a gap delay control block that links back to the start, so the engine
+// repeats the program with no help from the CPU.
+void DMAChannel::loopProgram(uint32_t gapTicks) {
+  if (!loopCB) {
+    loopCB = dmaMalloc(sizeof(DMAControlBlock));
+  }
+  if (gapTicks == 0) gapTicks = 1;
+  setDelayCB(reinterpret_cast<DMAControlBlock *>(loopCB->virtualAddr), gapTicks, ithCBBusAddr(1));
+  ithCBVirtAddr(cbCount - 1)->nextCB = loopCB->busAddr;
+  loopTicks = programTicks + gapTicks;
+  looping = true;
+  LOG_INFO("CB program loops every %.3f seconds\n", loopTicks / tickRate);
+}
+
+// The gap stops linking back, so the program ends after the gap that follows the cycle being sent - or the next
+// cycle, if the engine had already loaded the gap control block.
+void DMAChannel::stopLoop() {
+  if (!looping) return;
+  reinterpret_cast<DMAControlBlock *>(loopCB->virtualAddr)->nextCB = 0;
+  looping = false;
+  uint64_t cycles = static_cast<uint64_t>(secondsSinceStart() * tickRate) / loopTicks + 1;
+  if (dmaReg->cbAddr == loopCB->busAddr) cycles++;
+  programTicks = cycles * loopTicks;
+  LOG_INFO("Loop stopped, the program ends after cycle %llu\n", static_cast<unsigned long long>(cycles));
+}
+
+uint64_t DMAChannel::getLoopCycles() {
+  return started && loopTicks ? static_cast<uint64_t>(secondsSinceStart() * tickRate) / loopTicks : 0;
+}
+
+bool DMAChannel::inQueueProgram(int buffer) {
+  uint32_t cbAddr = dmaReg->cbAddr;
+  return cbIndex(queueCBs[buffer], cbAddr) >= 0;
+}
+
+// Waits for the engine to leave the control block at cbAddr, with a backoff that stays under a millisecond - false
+// if it is still there after timeout seconds.
+bool DMAChannel::waitToLeave(uint32_t cbAddr, double timeout) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  useconds_t backoff = 1;
+  while (dmaIsActive() && dmaReg->cbAddr == cbAddr) {
+    if (secondsSince(start) >= timeout) {
+      LOG_WARN("DMA channel %d still at control block %8.8x after %.1f ms\n", channel, cbAddr, timeout * 1000.0);
+      return false;
+    }
+    usleep(backoff);
+    if (backoff < 640) backoff *= 2;
+  }
+  return true;
+}
+
+// The message is compiled into whichever program isn't being played (waiting, if both are queued, until the engine
+// moves on to the later one), and then the terminating control block of the playing program is linked to it past
+// its FIFO fill control block.  The engine keeps its own copy of a control block, so if it had already loaded the
+// terminating control block the link is missed and the channel stops - then the message is started on its own.
+double DMAChannel::queueMessage(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol) {
+  if (!queueCBs[0] && !queueCBs[1]) {
+    queueCBs[queueLast] = dmaCBs;  // a program already loaded becomes one of the two
+  }
+  int buffer = 1 - queueLast;
+  while (dmaIsActive() && inQueueProgram(buffer)) {
+    usleep(1000);
+  }
+  uint64_t queuedTicks = programTicks;  // the playing program's end until it is linked
+  uint64_t messageTicks = subSymbolsSize * clocksPerSubSymbol;
+  allocCBs(&queueCBs[buffer], 2 * countRuns(subSymbols, subSymbolsSize) + 2);
+  uint32_t count = compileProgram(queueCBs[buffer], subSymbols, subSymbolsSize, clocksPerSubSymbol, 0, 0);
+  queueTail[buffer] = count - 1;
+  double slack = -1.0;
+  bool stalled = false;
+  if (dmaIsActive() && inQueueProgram(queueLast)) {
+    DMAControlBlock * tail = cbVirtAddr(queueCBs[queueLast], queueTail[queueLast]);
+    uint32_t tailBusAddr = cbBusAddr(queueCBs[queueLast], queueTail[queueLast]);
+    slack = (queuedTicks + 1) / tickRate - secondsSinceStart();
+    tail->nextCB = cbBusAddr(queueCBs[buffer], 1);
+    stalled = !waitToLeave(tailBusAddr, QUEUE_LINK_TIMEOUT);
+    if (dmaIsActive()) {
+      programTicks += messageTicks;  // the predicted end moves out by this message
     } else {
-      index++;
-      cb = ithCBVirtAddr(index);
+      slack = -1.0;
+    }
+  }
+  if (slack < 0.0) {  // the channel has stopped, so the message becomes the loaded program
+    dmaCBs = queueCBs[buffer];
+    cbCount = count;
+    programTicks = messageTicks;
+    characterStarts.clear();
+    glyphProgram = false;
+    looping = false;
+    reportProgram(subSymbolsSize, clocksPerSubSymbol);
+    restarts++;
+    dmaStart();
+  } else if (!stalled && (queued == restarts || slack < minimumSlack)) {
+    minimumSlack = slack;
+  }
+  queueLast = buffer;
+  queued++;
+  if (stalled) {
+    // linked, and sent if the engine moves on
+    LOG_ERROR("Queued message %d: the DMA engine has stalled at the end of the playing program\n", queued);
+    return -2.0;
+  } else if (slack < 0.0) {
+    LOG_INFO("Queued message %d: the channel had stopped, started it\n", queued);
+  } else {
+    LOG_INFO("Queued message %d: linked with %.3f seconds of compile-ahead slack\n", queued, slack);
+  }
+  return slack;
+}
+
+bool DMAChannel::inPriorityProgram() {
+  uint32_t cbAddr = dmaReg->cbAddr;
+  return cbIndex(priorityCBs, cbAddr) >= 0;
+}
+
+// The index of the control block of the loaded program the engine is at - for a glyph program in a fragment, the
+// link control block of the character being sent, and in a priority message, the control block it returns to.
+// -1 when it can't be told.
+int DMAChannel::programIndex(uint32_t cbAddr) {
+  int index = cbIndex(dmaCBs, cbAddr);
+  if (index >= 0 && index < static_cast<int>(cbCount)) {
+    return index;
+  }
+  if (glyphProgram && cbAddr >= glyphCBs->busAddr && cbAddr < glyphCBs->busAddr + glyphCBs->size) {
+    DMAControlBlock * glyphs = reinterpret_cast<DMAControlBlock *>(glyphCBs->virtualAddr);
+    uint32_t next = glyphs[glyphs[(cbAddr - glyphCBs->busAddr) / sizeof(DMAControlBlock)].padding[1]].nextCB;
+    index = cbIndex(dmaCBs, next);
+    if (index >= 1 && index < static_cast<int>(cbCount)) {
+      return index - 1;  // the link before the next one
     }
-  } while (notDone);
-  */
+  }
+  if (cbIndex(priorityCBs, cbAddr) >= 0) {
+    return priorityReturn;
+  }
+  return -1;
 }
 
+// A character is entered from the control block before its start: through that control block's next control block
+// in a run compiled program, or through the address a glyph program's link control block writes into the previous
+// fragment (or, once it has, the fragment's tail).  Each is a single word, so the splice is atomic, but the engine
+// may already have read it - then the word is put back and the next character is tried.
+double DMAChannel::sendPriority(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol) {
+  struct timespec requested;
+  clock_gettime(CLOCK_MONOTONIC, &requested);
+  while (dmaIsActive() && inPriorityProgram()) {  // the last priority message is still being sent
+    usleep(1000);
+  }
+  if (ringSlots || characterStarts.empty() || !dmaIsActive()) {
+    return -1.0;
+  }
+  allocCBs(&priorityCBs, 2 * countRuns(subSymbols, subSymbolsSize));
+  int last = compileRuns(priorityCBs, 0, subSymbols, subSymbolsSize, clocksPerSubSymbol, 0, 0) - 1;
+  DMAControlBlock * priorityLast = cbVirtAddr(priorityCBs, last);
+
+  uint64_t priorityTicks = subSymbolsSize * clocksPerSubSymbol;
+  auto start = characterStarts.begin();
+  while (dmaIsActive()) {
+    uint32_t cbAddr = dmaReg->cbAddr;
+    int position = programIndex(cbAddr);
+    // in a glyph fragment, the link control block has already set where the fragment's tail goes next
+    bool inFragment = glyphProgram && position >= 0 && cbAddr >= glyphCBs->busAddr &&
+      cbAddr < glyphCBs->busAddr + glyphCBs->size;
+    start = std::upper_bound(start, characterStarts.end(), position + (inFragment ? 0 : 1),
+                             [](int index, const CharacterStart & character) {
+                               return index < static_cast<int>(character.cb);
+                             });
+    if (position < 0 || start == characterStarts.end()) break;
+    uint32_t entry = start->cb - 1;
+    uint32_t * splice = glyphProgram ? &ithCBVirtAddr(entry)->padding[0] : &ithCBVirtAddr(entry)->nextCB;
+    if (inFragment && static_cast<int>(entry) == position) {
+      DMAControlBlock * glyphs = reinterpret_cast<DMAControlBlock *>(glyphCBs->virtualAddr);
+      splice = &glyphs[glyphs[(cbAddr - glyphCBs->busAddr) / sizeof(DMAControlBlock)].padding[1]].nextCB;
+    }
+    uint32_t resume = *splice;
+    priorityLast->nextCB = resume;
+    priorityReturn = start->cb;
+    __sync_synchronize();
+    *splice = cbBusAddr(priorityCBs, 0);
+    while (dmaIsActive() && !inPriorityProgram() && programIndex(dmaReg->cbAddr) <= static_cast<int>(entry)) {
+      usleep(100);
+    }
+    bool spliced = inPriorityProgram();
+    *splice = resume;  // the engine has gone past it either way
+    if (spliced) {
+      // the predicted end moves out only once the engine has taken the splice - it is still short of the old end
+      programTicks += priorityTicks;
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double latency = (now.tv_sec - requested.tv_sec) + (now.tv_nsec - requested.tv_nsec) / 1e9;
+      priorities++;
+      LOG_INFO("Priority message %d spliced in before character %d, %.3f ms after it was sent\n", priorities,
+               static_cast<int>(start - characterStarts.begin()) + 1, latency * 1000.0);
+      return latency;
+    }
+    start++;
+  }
+  LOG_INFO("Priority message: no character boundary left to splice at\n");
+  return -1.0;
+}
+
+void DMAChannel::reportQueue() {
+  LOG_INFO("Queue: %d messages, %d linked with no gap (minimum compile-ahead slack %.3f seconds), "
+           "%d started the channel\n", queued, queued - restarts, minimumSlack, restarts);
+}
+
+// Every piece of DMA memory the channel holds is given to the verifier, since a program can run through the glyph
+// cache, the loop gap and the other queued program as well as its own control blocks.
+CBVerifier::Result DMAChannel::verifyProgram() {
+  CBVerifier verifier(tickRate);
+  for (CBStorage * storage : { dmaCBs, queueCBs[0], queueCBs[1], priorityCBs }) {
+    if (!storage) continue;
+    for (DMAMemHandle * chunk : storage->chunks) {
+      verifier.addRegion(chunk->busAddr, chunk->virtualAddr, chunk->size);
+    }
+  }
+  for (DMAMemHandle * memory : { glyphCBs, loopCB, commandPinToClock, commandPinToInput }) {
+    if (memory) verifier.addRegion(memory->busAddr, memory->virtualAddr, memory->size);
+  }
+  for (uint32_t pin : keyedPins) {
+    verifier.watchPin(pin);
+  }
+  CBVerifier::Result result = verifier.verify(ithCBBusAddr(0));
+  verifier.report(result);
+  if (result.terminated && ringSlots == 0 && result.ticks != programTicks + 1) {
+    LOG_WARN("CB verify: the program runs %llu PCM clocks, %llu were predicted\n",
+             static_cast<unsigned long long>(result.ticks), static_cast<unsigned long long>(programTicks + 1));
+  }
+  return result;
+}
 
 void DMAChannel::dmaStart() {
+  stopWatcher();
+  if (aborted) {
+    LOG_WARN("DMA channel %d was aborted, not starting it\n", channel);
+    return;
+  }
   // Reset the DMA channel
-  fprintf(stderr, "Starting DMA channel controller\n");
+  LOG_DEBUG("Starting DMA channel controller\n");
   dmaReg->cs = DMA_CHANNEL_ABORT;
   dmaReg->cs = 0;
   dmaReg->cs = DMA_CHANNEL_RESET;
@@ -157,15 +1081,181 @@ void DMAChannel::dmaStart() {
   dmaReg->cbAddr = ithCBBusAddr(0);
   dmaReg->cs = DMA_PRIORITY(8) | DMA_PANIC_PRIORITY(8) | DMA_DISDEBUG;
   dmaReg->cs |= DMA_WAIT_ON_WRITES | DMA_ACTIVE;
+  clock_gettime(CLOCK_MONOTONIC, &startTime);
+  started = true;
+
+  if (completionFD >= 0) {
+    stopWaiting = false;
+    watcher = std::thread(&DMAChannel::completionWatcher, this);
+  }
+}
+
+bool DMAChannel::keyedPinsDown() {
+  for (int index = 0; index < abortRegisters; index++) {
+    if (gpioReg[abortOffsets[index] / 4] & abortMasks[index]) return true;
+  }
+  return false;
+}
+
+// The engine is paused so that its next control block register can be written, pointed at the abort terminator,
+// and the control block it is in is aborted, so the next thing it does is set the keyed pins to input and end.
+// The function select registers are then read back.  If the engine hasn't ended in time the channel is reset and
+// the pins are set to input by the CPU.  Only register and memory accesses and clock_gettime (async signal safe)
+// are used, and the waits spin, so this can be called from a signal handler.  The spin holds the core, so on a
+// single core the emulator's engine thread can't run and the CPU does the key up.
+double DMAChannel::abortProgram() {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  aborted = true;
+  if (dmaIsActive()) {
+    dmaReg->cs &= ~DMA_ACTIVE;
+    while (!(dmaReg->cs & DMA_PAUSED) && secondsSince(start) < ABORT_TIMEOUT) {
+    }
+    dmaReg->nextCB = abortCBs->busAddr;
+    dmaReg->cs |= DMA_CHANNEL_ABORT | DMA_ACTIVE;
+    while (dmaIsActive() && secondsSince(start) < ABORT_TIMEOUT) {
+    }
+  }
+  abortForced = dmaIsActive() || keyedPinsDown();
+  if (abortForced) {
+    dmaReg->cs = DMA_CHANNEL_RESET;
+    for (int index = 0; index < abortRegisters; index++) {
+      gpioReg[abortOffsets[index] / 4] &= ~abortMasks[index];
+    }
+  }
+  abortConfirmed = !keyedPinsDown();
+  abortLatency = secondsSince(start);
+  return abortLatency;
+}
+
+double DMAChannel::secondsSinceStart() {
+  return secondsSince(startTime);
+}
+
+// Sleep through most of the program, as predicted from its length in PCM clocks, then poll with a backoff that
+// stays under a millisecond.  The guard before the predicted end covers PCM clock error and wakeup latency.
+bool DMAChannel::waitForCompletion(double timeout) {
+  const double SLEEP_SLICE = 0.1;  // seconds - a stop request or an early end is seen at least this often
+  const useconds_t MAXIMUM_BACKOFF = 640;
+  double deadline = secondsSinceStart() + timeout;
+  useconds_t backoff = 20;
+  double lastActive = secondsSinceStart();
+  while (dmaIsActive()) {
+    double now = secondsSinceStart();
+    if (stopWaiting || now >= deadline) return false;
+    lastActive = now;
+    // the predicted end is read each time round - a queued or priority message moves it out
+    double predictedEnd = getPredictedDuration();
+    double wake = std::min(predictedEnd - (0.002 + predictedEnd * 0.001), deadline);
+    if (now < wake) {
+      usleep(1e6 * std::min(wake - now, SLEEP_SLICE));
+      backoff = 20;
+      continue;
+    }
+    usleep(backoff);
+    if (backoff < MAXIMUM_BACKOFF) backoff *= 2;
+  }
+  double detected = secondsSinceStart();
+  completionLatency = detected - lastActive;
+  completionError = detected - getPredictedDuration();
+  return true;
+}
+
+void DMAChannel::completionWatcher() {
+  if (waitForCompletion(1e9)) {
+    uint64_t count = 1;
+    if (write(completionFD, &count, sizeof(count)) != sizeof(count)) {
+      perror("Failed to signal DMA completion: ");
+    }
+  }
+}
+
+// In a run compiled program the control block address is looked up in the character start index.  In a glyph
+// program it is either a link control block (one per character) or inside a shared fragment, where the fragment's
+// tail holds the address of the next link control block.
+Progress DMAChannel::progress() {
+  Progress current = { 0, 0, static_cast<uint32_t>(characterStarts.size()), 0, 0.0, 0.0, 0.0 };
+  uint32_t cbAddr = dmaReg->cbAddr;
+  current.running = dmaIsActive();
+  if (started) {
+    double end = getPredictedDuration();
+    current.elapsed = secondsSinceStart();
+    if (looping) {  // progress through the cycle being sent
+      end = loopTicks / tickRate;
+      current.elapsed = fmod(current.elapsed, end);
+    }
+    current.remaining = current.running && end > current.elapsed ? end - current.elapsed : 0.0;
+  }
+  if (!current.running) {
+    current.character = started ? current.characters : 0;
+    current.percent = started ? 100.0 : 0.0;
+  } else if (!characterStarts.empty()) {
+    int cbIndex = programIndex(cbAddr);
+    if (cbIndex >= 0) {
+      // the last character that starts at or before this control block
+      size_t low = 0;
+      size_t high = characterStarts.size();
+      while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (characterStarts[middle].cb <= static_cast<uint32_t>(cbIndex)) {
+          low = middle + 1;
+        } else {
+          high = middle;
+        }
+      }
+      current.character = low > 0 ? low - 1 : 0;
+    }
+    if (current.character >= current.characters) current.character = current.characters - 1;
+    current.percent = programTicks ? 100.0 * characterStarts[current.character].tick / programTicks : 0.0;
+  }
+  if (statsPage) statsPage->publish(current);
+  return current;
+}
+
+int DMAChannel::getCompletionFD() {
+  if (completionFD < 0) {
+    completionFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completionFD < 0) {
+      perror("Failed to create DMA completion eventfd: ");
+      exit(-1);
+    }
+  }
+  return completionFD;
+}
+
+void DMAChannel::stopWatcher() {
+  if (watcher.joinable()) {
+    stopWaiting = true;
+    watcher.join();
+  }
+  stopWaiting = false;
+}
+
+// the error flags are cleared by writing 1, and the rest of the register is read only
+void DMAChannel::clearErrors(uint32_t errors) {
+  dmaReg->debug = errors;
 }
 
 bool DMAChannel::dmaIsRunning() {
-  fprintf(stderr, "dmaReg->cs : %8.8x\n", dmaReg->cs);
-  return ((dmaReg->cs & DMA_ACTIVE) != 0);
+  LOG_DEBUG("dmaReg->cs : %8.8x\n", dmaReg->cs);
+  return dmaIsActive();
+}
+
+// true once the FIFO has been filled and the first key control block has been reached (or the program has ended)
+bool DMAChannel::dmaKeyingStarted() {
+  uint32_t cbAddr = dmaReg->cbAddr;
+  return !dmaIsActive() || (cbAddr != 0 && cbAddr != ithCBBusAddr(0));
 }
 
 void DMAChannel::dmaEnd() {
-  fprintf(stderr, "Stopping DMA channel controller\n");
+  LOG_INFO("Stopping DMA channel controller\n");
+  if (aborted && abortConfirmed) {
+    LOG_INFO("Aborted: key up confirmed %.3f ms after the abort request, %s\n", abortLatency * 1000.0,
+             abortForced ? "forced by the CPU" : "by the DMA terminator");
+  } else if (aborted) {
+    LOG_ERROR("Aborted: a keyed pin still reads back as an output %.3f ms after the abort request\n",
+              abortLatency * 1000.0);
+  }
   // Shutdown DMA channel.
   dmaReg->cs |= DMA_CHANNEL_ABORT;
   usleep(100);
@@ -174,24 +1264,63 @@ void DMAChannel::dmaEnd() {
   usleep(100);
 
   // Release the memory used by DMA
-  dmaFree(dmaCBs);
+  if (dmaCBs) {
+    dmaFreeCBs(dmaCBs);
+  }
+  for (CBStorage * program : queueCBs) {
+    if (program && program != dmaCBs) {
+      dmaFreeCBs(program);
+    }
+  }
+  if (glyphCBs) {
+    dmaFree(glyphCBs);
+    free(glyphCBs);
+  }
+  if (loopCB) {
+    dmaFree(loopCB);
+    free(loopCB);
+  }
+  if (priorityCBs) {
+    dmaFreeCBs(priorityCBs);
+  }
+  dmaFree(abortCBs);
+  free(abortCBs);
   dmaFree(commandPinToClock);
   dmaFree(commandPinToInput);
 
-  free(dmaCBs);
   free(commandPinToClock);
   free(commandPinToInput);
+  delete arena;
 }
 
 DMAChannel::DMAChannel(char * subSymbols, size_t subSymbolsSize, uint32_t clocksPerSubSymbol, uint32_t channel,
-                       GPIO * gpio, Peripheral * peripheralUtil) {
-  dmaAllocBuffers(subSymbolsSize, clocksPerSubSymbol, gpio);
+                       GPIO * gpio, Peripheral * peripheralUtil) : DMAChannel(channel, gpio, peripheralUtil) {
+  loadMessage(subSymbols, subSymbolsSize, clocksPerSubSymbol);
+}
+
+DMAChannel::DMAChannel(uint32_t channel, GPIO * gpio, Peripheral * peripheralUtil) {
+  this->peripheralUtil = peripheralUtil;
+  arena = new DMAArena(peripheralUtil);
+  dmaAllocBuffers(gpio);
   uint8_t * dmaBasePtr = reinterpret_cast<uint8_t *>(peripheralUtil->mapPeripheralToUserSpace(DMA_BASE, PAGE_SIZE));
   dmaReg = reinterpret_cast<DMACtrlReg *>(dmaBasePtr + channel * 0x100);
+  gpioReg = reinterpret_cast<uint32_t *>(peripheralUtil->mapPeripheralToUserSpace(GPIO_BASE, GPIO_MODE_SIZE));
   this->channel = channel;
-  fprintf(stderr, "Constructing object for DMA channel %d\n", channel);
-  dmaInitCBs(subSymbols, subSymbolsSize, clocksPerSubSymbol);
+  streaming = false;
+  stopWaiting = false;
+  LOG_INFO("Constructing object for DMA channel %d\n", channel);
 }
+DMAChannel::DMAChannel(uint32_t ringSlots, uint32_t channel, GPIO * gpio, Peripheral * peripheralUtil)
+  : DMAChannel(channel, gpio, peripheralUtil) {
+  this->ringSlots = ringSlots;
+  // FIFO fill control block and a key and a delay control block per slot
+  dmaAllocCBs(2 * ringSlots + 1);
+  LOG_INFO("DMA channel %d is streaming through a ring of %d slots\n", channel, ringSlots);
+}
+
 DMAChannel::~DMAChannel(void) {
+  streamStop();
+  stopWatcher();
   dmaEnd();
+  if (completionFD >= 0) close(completionFD);
 }
@@ -0,0 +1,267 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Transmitter daemon - the clocks, PCM and DMA memory are initialized once and reused for every request
+
+Mark Broihier 2021
+*/
+
+#include "../include/Daemon.h"
+
+double Daemon::millisecondsBetween(const struct timespec * from, const struct timespec * to) {
+  return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+void Daemon::reply(int clientFD, const char * text) {
+  if (write(clientFD, text, strlen(text)) < 0) {
+    perror("Failed to reply to client: ");
+  }
+  close(clientFD);
+}
+
+bool Daemon::readRequest(int clientFD, Request * request) {
+  char * line = reinterpret_cast<char *>(malloc(MAXIMUM_REQUEST_SIZE));
+  size_t lineSize = 0;
+  // read up to the end of the line
+  while (lineSize < MAXIMUM_REQUEST_SIZE - 1) {
+    ssize_t count = read(clientFD, line + lineSize, MAXIMUM_REQUEST_SIZE - 1 - lineSize);
+    if (count <= 0) break;
+    lineSize += count;
+    if (memchr(line + lineSize - count, '\n', count)) break;
+  }
+  line[lineSize] = 0;
+  char * end = strchr(line, '\n');
+  if (end) *end = 0;
+  clock_gettime(CLOCK_MONOTONIC, &request->received);
+
+  int messageOffset = 0;
+  unsigned rate = 0;
+  unsigned frequency = 0;
+  bool priority = line[0] == '!';
+  if (sscanf(line + priority, "%u %u %n", &rate, &frequency, &messageOffset) < 2 || messageOffset == 0 ||
+      line[priority + messageOffset] == 0) {
+    reply(clientFD, "ERROR expected: <transmission rate> <frequency> <message>\n");
+    free(line);
+    return false;
+  }
+  if (rate == 0 || PCMHW::clocksPerSubSymbol(rate) == 0) {
+    reply(clientFD, "ERROR transmission rate out of range\n");
+    free(line);
+    return false;
+  }
+  messageOffset += priority;
+  if (!MorseEncoder::isEncodable(line + messageOffset)) {
+    reply(clientFD, "ERROR message contains characters that can not be encoded\n");
+    free(line);
+    return false;
+  }
+  request->clientFD = clientFD;
+  request->rate = rate;
+  request->frequency = frequency;
+  request->message = strdup(line + messageOffset);
+  request->priority = priority;
+  free(line);
+  return true;
+}
+
+// runs on its own thread so requests are timestamped and queued while a message is being transmitted
+void Daemon::acceptRequests() {
+  while (!stopping) {
+    int clientFD = accept(listenFD, NULL, NULL);
+    if (clientFD < 0) {
+      if (!stopping) perror("accept failed: ");
+      continue;
+    }
+    struct timeval timeout = { 2, 0 };  // a client that stalls must not hold up other requests
+    setsockopt(clientFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Request request;
+    if (readRequest(clientFD, &request)) {
+      std::lock_guard<std::mutex> lock(queueLock);
+      if (request.priority) {
+        priorityQueue.push_back(request);
+        uint64_t count = 1;
+        if (write(priorityFD, &count, sizeof(count)) != sizeof(count)) {
+          perror("Failed to signal a priority request: ");
+        }
+      } else {
+        queue.push_back(request);
+      }
+      queueReady.notify_one();
+    }
+  }
+}
+
+// Priority requests are spliced into the message being sent, in order, until one can't be.  That one stays at the
+// front of the priority queue and is sent after the message.
+void Daemon::splicePriorityRequests() {
+  uint64_t count;
+  if (read(priorityFD, &count, sizeof(count)) != sizeof(count)) {
+    return;
+  }
+  while (true) {
+    Request request;
+    {
+      std::lock_guard<std::mutex> lock(queueLock);
+      if (priorityQueue.empty()) return;
+      request = priorityQueue.front();
+      priorityQueue.pop_front();
+    }
+    double latency = -1.0;
+    if (request.frequency == 0) {
+      // a word space on either side separates it from the message
+      size_t textSize = strlen(request.message) + 3;
+      char * text = reinterpret_cast<char *>(malloc(textSize));
+      snprintf(text, textSize, " %s ", request.message);
+      size_t subSymbolsSize = (textSize - 1) * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+      char * subSymbols = reinterpret_cast<char *>(malloc(subSymbolsSize));
+      subSymbolsSize = MorseEncoder::encode(text, textSize - 1, subSymbols, subSymbolsSize);
+      latency = dma->sendPriority(subSymbols, subSymbolsSize, PCMHW::clocksPerSubSymbol(request.rate));
+      free(subSymbols);
+      free(text);
+    }
+    if (latency < 0.0) {
+      std::lock_guard<std::mutex> lock(queueLock);
+      priorityQueue.push_front(request);
+      return;
+    }
+    struct timespec spliced;
+    clock_gettime(CLOCK_MONOTONIC, &spliced);
+    char text[128];
+    snprintf(text, sizeof(text), "OK spliced_ms=%.3f\n", millisecondsBetween(&request.received, &spliced));
+    LOG_INFO("Priority request \"%s\" at %d wpm spliced in\n", request.message, request.rate);
+    reply(request.clientFD, text);
+    free(request.message);
+  }
+}
+
+void Daemon::transmit(Request * request, volatile sig_atomic_t * exitRequested) {
+  struct timespec started;
+  struct timespec firstKey;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if (request->frequency != 0) {
+    clock->setFrequency(request->frequency);
+  }
+  // repeated requests at the same rate only need link control blocks
+  dma->loadGlyphMessage(request->message, PCMHW::clocksPerSubSymbol(request->rate));
+  dma->dmaStart();
+  while (!dma->dmaKeyingStarted()) {
+    usleep(100);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &firstKey);
+  // the channel's completion watcher signals the eventfd - wake every 100 ms to check for shutdown and to
+  // publish progress, and when a priority request arrives
+  struct pollfd events[2] = { { completionFD, POLLIN, 0 }, { priorityFD, POLLIN, 0 } };
+  struct pollfd & completion = events[0];
+  while (!*exitRequested && (poll(events, 2, 100) <= 0 || !(completion.revents & POLLIN))) {
+    if (events[1].revents & POLLIN) {
+      splicePriorityRequests();
+    }
+    dma->progress();
+  }
+  dma->progress();
+  uint64_t count;
+  if (completion.revents & POLLIN && read(completionFD, &count, sizeof(count)) != sizeof(count)) {
+    perror("Failed to read DMA completion: ");
+  }
+
+  char text[128];
+  double queueWait = millisecondsBetween(&request->received, &started);
+  double timeToFirstKey = millisecondsBetween(&request->received, &firstKey);
+  LOG_INFO("Request \"%s\" at %d wpm: queue wait %.3f ms, time to first key %.3f ms\n", request->message,
+           request->rate, queueWait, timeToFirstKey);
+  if (*exitRequested) {
+    snprintf(text, sizeof(text), "ERROR transmitter shut down\n");
+  } else {
+    snprintf(text, sizeof(text), "OK queue_wait_ms=%.3f first_key_ms=%.3f done_detect_ms=%.3f\n", queueWait,
+             timeToFirstKey, dma->getCompletionLatency() * 1000.0);
+  }
+  reply(request->clientFD, text);
+}
+
+void Daemon::run(volatile sig_atomic_t * exitRequested) {
+  acceptor = std::thread(&Daemon::acceptRequests, this);
+  LOG_INFO("Daemon is waiting for requests on %s\n", socketPath);
+  while (!*exitRequested) {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(queueLock);
+      if (!queueReady.wait_for(lock, std::chrono::milliseconds(100),
+                               [this] { return !queue.empty() || !priorityQueue.empty(); })) {
+        continue;
+      }
+      std::deque<Request> & next = priorityQueue.empty() ? queue : priorityQueue;
+      request = next.front();
+      next.pop_front();
+    }
+    transmit(&request, exitRequested);
+    free(request.message);
+  }
+}
+
+Daemon::Daemon(const char * socketPath, Clock * clock, DMAChannel * dma) {
+  this->socketPath = socketPath;
+  this->clock = clock;
+  this->dma = dma;
+  completionFD = dma->getCompletionFD();
+  priorityFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  stopping = false;
+  signal(SIGPIPE, SIG_IGN);  // a client that goes away before its reply must not end the daemon
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(address.sun_path)) {
+    LOG_ERROR("Socket path %s is too long\n", socketPath);
+    exit(-1);
+  }
+  strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+  unlink(socketPath);
+  if ((listenFD = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+      bind(listenFD, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+      listen(listenFD, 16) < 0) {
+    perror("Failed to create daemon socket: ");
+    exit(-1);
+  }
+}
+
+Daemon::~Daemon() {
+  LOG_INFO("Shutting down Daemon\n");
+  stopping = true;
+  shutdown(listenFD, SHUT_RDWR);  // wakes up the acceptor
+  if (acceptor.joinable()) {
+    acceptor.join();
+  }
+  close(listenFD);
+  unlink(socketPath);
+  for (std::deque<Request> * pending : { &priorityQueue, &queue }) {
+    for (Request & request : *pending) {
+      reply(request.clientFD, "ERROR transmitter shut down\n");
+      free(request.message);
+    }
+  }
+  close(priorityFD);
+}
@@ -0,0 +1,454 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Emulated peripherals, mailbox memory and DMA engine
+
+Mark Broihier 2021
+*/
+
+#include "../include/Emulator.h"
+
+// DMA control block transfer information bits the engine honors besides the ones in DMAChannel.h
+#define DMA_DEST_INC (1 << 4)
+#define DMA_SRC_INC (1 << 8)
+#define DMA_PERMAP(x) (((x) >> 16) & 0x1f)
+#define DMA_DEBUG_ERRORS (DMA_DEBUG_READ_ERROR | DMA_DEBUG_FIFO_ERROR | DMA_DEBUG_READ_LAST_NOT_SET_ERROR)
+#define DMA_DEBUG_VERSION(x) ((x) << 25)
+
+// PCM status bits the emulator shows
+#define PCM_CTL_TXSYNC (1 << 13)
+#define PCM_CTL_TXD (1 << 19)
+#define PCM_CTL_TXE (1 << 21)
+
+uint32_t Emulator::peripheralBase() {
+  return EMULATED_PERIPHERAL_BASE;
+}
+
+void * Emulator::mapPhysical(uint32_t physicalAddress, size_t size) {
+  uint32_t offset = physicalAddress - EMULATED_PERIPHERAL_BASE;
+  if (physicalAddress < EMULATED_PERIPHERAL_BASE || offset + size > PERIPHERAL_SIZE) {
+    LOG_ERROR("Emulator: %8.8x is not a peripheral address\n", physicalAddress);
+    exit(-1);
+  }
+  return peripherals + offset;
+}
+
+void Emulator::unmapPhysical(void * /* address */, size_t /* size */) {
+}
+
+int Emulator::mboxOpen() {
+  return 0;
+}
+
+void Emulator::mboxClose(int /* fileDesc */) {
+}
+
+// first fit from the free blocks of the emulated GPU memory
+uint32_t Emulator::memAlloc(int /* fileDesc */, uint32_t size, uint32_t align, uint32_t /* flags */) {
+  std::lock_guard<std::mutex> lock(memoryLock);
+  for (auto block = freeBlocks.begin(); block != freeBlocks.end(); block++) {
+    uint32_t start = (block->first + align - 1) / align * align;
+    if (start + size > block->first + block->second) continue;
+    uint32_t blockStart = block->first;
+    uint32_t blockEnd = block->first + block->second;
+    freeBlocks.erase(block);
+    if (start > blockStart) freeBlocks[blockStart] = start - blockStart;
+    if (start + size < blockEnd) freeBlocks[start + size] = blockEnd - (start + size);
+    Allocation allocation = { start, size };
+    allocations[nextHandle] = allocation;
+    return nextHandle++;
+  }
+  LOG_WARN("Emulator: mailbox allocation of %d bytes failed\n", size);
+  return 0;
+}
+
+uint32_t Emulator::memFree(int /* fileDesc */, uint32_t handle) {
+  std::lock_guard<std::mutex> lock(memoryLock);
+  auto allocation = allocations.find(handle);
+  if (allocation == allocations.end()) return 0;
+  uint32_t start = allocation->second.offset;
+  uint32_t size = allocation->second.size;
+  allocations.erase(allocation);
+  // coalesce with the neighboring free blocks
+  auto next = freeBlocks.lower_bound(start);
+  if (next != freeBlocks.end() && next->first == start + size) {
+    size += next->second;
+    freeBlocks.erase(next);
+  }
+  auto previous = freeBlocks.lower_bound(start);
+  if (previous != freeBlocks.begin()) {
+    previous--;
+    if (previous->first + previous->second == start) {
+      start = previous->first;
+      size += previous->second;
+      freeBlocks.erase(previous);
+    }
+  }
+  freeBlocks[start] = size;
+  return 0;
+}
+
+uint32_t Emulator::memLock(int /* fileDesc */, uint32_t handle) {
+  std::lock_guard<std::mutex> lock(memoryLock);
+  auto allocation = allocations.find(handle);
+  if (allocation == allocations.end()) return 0;
+  return 0xC0000000 | (GPU_PHYS_BASE + allocation->second.offset);  // L1 non-allocating alias
+}
+
+uint32_t Emulator::memUnlock(int /* fileDesc */, uint32_t /* handle */) {
+  return 0;
+}
+
+void * Emulator::mapMem(uint32_t base, uint32_t size) {
+  if (base < GPU_PHYS_BASE || base - GPU_PHYS_BASE + size > gpuMemorySize) {
+    LOG_ERROR("Emulator: %8.8x is not mailbox memory\n", base);
+    exit(-1);
+  }
+  return gpuMemory + (base - GPU_PHYS_BASE);
+}
+
+void Emulator::unmapMem(void * /* address */, uint32_t /* size */) {
+}
+
+void * Emulator::busToVirtual(uint32_t busAddr) {
+  if ((busAddr & 0xFF000000) == PERI_BUS_BASE) {
+    return peripherals + (busAddr & (PERIPHERAL_SIZE - 1));
+  }
+  uint32_t physical = BUS_TO_PHYS(busAddr);
+  if (physical >= GPU_PHYS_BASE && physical - GPU_PHYS_BASE < gpuMemorySize) {
+    return gpuMemory + (physical - GPU_PHYS_BASE);
+  }
+  return 0;
+}
+
+// PCM frame rate from the PCM clock source, its divider and the PCM frame length
+double Emulator::pcmTickRate() {
+  uint32_t control = *reg(CM_BASE + PCMCLK * 8);
+  uint32_t divider = *reg(CM_BASE + PCMCLK * 8 + 4);
+  double source = (control & 0xf) == CLK_CTL_SRC_OSC ? XOSC_FREQUENCY : EMULATED_PLLD_FREQUENCY;
+  double divisor = ((divider >> 12) & 0xfff) + (divider & 0xfff) / 4096.0;
+  uint32_t frameLength = ((*reg(PCM_BASE + 0x8) >> 10) & 0x3ff) + 1;
+  if (divisor < 1.0) return 1000.0;  // PCM clock not programmed yet
+  return source / divisor / frameLength;
+}
+
+double Emulator::secondsOfTick(uint64_t tick) {
+  return tickBase.tv_sec + tickBase.tv_nsec / 1e9 + (tick - tickBaseCount) / tickRate;
+}
+
+// drain the FIFO by one word per PCM clock up to now
+void Emulator::advancePCM() {
+  double rate = pcmTickRate();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (rate != tickRate) {  // the PCM clock has been reprogrammed
+    tickRate = rate;
+    tickBase = now;
+    tickBaseCount = tick;
+  }
+  if (!realTime) return;
+  double elapsed = (now.tv_sec - tickBase.tv_sec) + (now.tv_nsec - tickBase.tv_nsec) / 1e9;
+  uint64_t nowTick = tickBaseCount + static_cast<uint64_t>(elapsed * tickRate);
+  while (tick < nowTick) {
+    tick++;
+    if (fifoLevel > 0) {
+      fifoLevel--;
+    } else if (fifoPrimed) {
+      underruns++;
+      pcmFlags.raised |= PCM_CTL_TXERR;
+    }
+  }
+}
+
+// clock manager control registers read back without the password, and BUSY follows ENAB unless KILL is set
+void Emulator::updateClockStatus() {
+  const uint32_t clocks[] = { CORECLK, GP0CLK, GP1CLK, GP2CLK, PCMCLK, EMMCCLK };
+  for (uint32_t clock : clocks) {
+    volatile uint32_t * control = reg(CM_BASE + clock * 8);
+    uint32_t value = *control;
+    uint32_t status = value & 0x00ffffff & ~CLK_CTL_BUSY;
+    if ((status & CLK_CTL_ENAB) && !(status & CLK_CTL_KILL)) status |= CLK_CTL_BUSY;
+    if (status != value) {
+      // a write by the program under test between the read and this update wins
+      __sync_bool_compare_and_swap(const_cast<uint32_t *>(control), value, status);
+    }
+  }
+}
+
+// Error flags are cleared by writing 1.  A register that no longer holds the value last put in it has been written by
+// the program under test, so the flags written as 1 are cleared; then the flags still raised and the read only
+// status are put back.  Writing back exactly the value read can't be told from no write - it clears nothing here.
+void Emulator::updateFlags(volatile uint32_t * flagReg, uint32_t flags, uint32_t statusMask, uint32_t status,
+                           FlagRegister * state) {
+  uint32_t value = *flagReg;
+  if (value != state->shown) state->raised &= ~(value & flags);
+  uint32_t next = (value & ~(flags | statusMask)) | state->raised | status;
+  if (next != value && !__sync_bool_compare_and_swap(const_cast<uint32_t *>(flagReg), value, next)) {
+    return;  // written again in between - seen on the next pass
+  }
+  state->shown = next;
+}
+
+void Emulator::updateErrorFlags() {
+  volatile uint32_t * control = reg(PCM_BASE);
+  uint32_t status = (*control & PCM_CTL_TXON ? PCM_CTL_TXSYNC : 0) | (fifoLevel < PCM_FIFO_SIZE ? PCM_CTL_TXD : 0) |
+    (fifoLevel == 0 ? PCM_CTL_TXE : 0);
+  updateFlags(control, PCM_CTL_TXERR | PCM_CTL_RXERR, PCM_CTL_STATUS, status, &pcmFlags);
+  for (int channel = 0; channel < DMA_CHANNELS; channel++) {
+    updateFlags(reg(DMA_BASE + channel * 0x100 + 0x20), DMA_DEBUG_ERRORS, ~DMA_DEBUG_ERRORS, DMA_DEBUG_VERSION(2),
+                &debugFlags[channel]);
+  }
+}
+
+void Emulator::loadCB(int channel, uint32_t cbAddr) {
+  ChannelState & state = channels[channel];
+  volatile uint32_t * dmaReg = reg(DMA_BASE + channel * 0x100);
+  uint32_t * cb = reinterpret_cast<uint32_t *>(busToVirtual(cbAddr));
+  if (!cb || (cbAddr & 0x1f)) {
+    LOG_WARN("Emulator: DMA channel %d bad control block address %8.8x\n", channel, cbAddr);
+    state.running = false;
+    dmaReg[0] = (dmaReg[0] & ~DMA_ACTIVE) | DMA_ERROR;
+    debugFlags[channel].raised |= DMA_DEBUG_READ_ERROR;
+    return;
+  }
+  state.running = true;
+  state.cbAddr = cbAddr;
+  state.txInfo = cb[0];
+  state.src = cb[1];
+  state.dest = cb[2];
+  state.remaining = cb[3] & 0x3fffffff;
+  state.nextCB = cb[5];  // the engine keeps its own copy, as the hardware does
+  for (int field = 0; field < 6; field++) {
+    dmaReg[2 + field] = cb[field];  // and shows it in its registers
+  }
+  dmaReg[1] = cbAddr;
+}
+
+void Emulator::writeWord(uint32_t destBusAddr, uint32_t value) {
+  if (destBusAddr == PERI_BUS_BASE + PCM_BASE + PCM_FIFO) {
+    fifoLevel++;
+    fifoPrimed = true;
+    return;
+  }
+  uint32_t * dest = reinterpret_cast<uint32_t *>(busToVirtual(destBusAddr));
+  if (!dest) return;
+  *dest = value;
+  for (WatchedPin & watched : watchedPins) {
+    if (destBusAddr != PERI_BUS_BASE + GPIO_BASE + GPIO_FSEL + 4 * (watched.pin / 10)) continue;
+    bool down = ((value >> ((watched.pin % 10) * 3)) & 7) != GPIO_FSEL_INPUT;  // any alternate function is the clock
+    if (down != watched.keyDown) {
+      if (watched.keyDown) watched.keyDownTicks += tick - watched.lastEdgeTick;
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      KeyEdge edge = { tick, realTime ? now.tv_sec + now.tv_nsec / 1e9 - secondsOfTick(tick) : 0.0, watched.pin,
+                       down };
+      std::lock_guard<std::mutex> lock(timelineLock);
+      timeline.push_back(edge);
+      watched.keyDown = down;
+      watched.lastEdgeTick = tick;
+    }
+  }
+}
+
+// run a channel as far as it can go without waiting for a PCM clock
+bool Emulator::stepChannel(int channel, bool * waiting) {
+  ChannelState & state = channels[channel];
+  volatile uint32_t * dmaReg = reg(DMA_BASE + channel * 0x100);
+  uint32_t cs = dmaReg[0];
+  if ((cs & DMA_CHANNEL_ABORT) && !(cs & DMA_CHANNEL_RESET) && dmaReg[7]) {
+    // the control block is dropped and the one in the next control block register (which the CPU may have written
+    // while the channel was paused) is loaded
+    __sync_fetch_and_and(const_cast<uint32_t *>(&dmaReg[0]), ~DMA_CHANNEL_ABORT);
+    loadCB(channel, dmaReg[7]);
+    return true;
+  }
+  if (cs & (DMA_CHANNEL_RESET | DMA_CHANNEL_ABORT)) {
+    state.running = false;
+    fifoPrimed = false;
+    dmaReg[0] = cs & ~(DMA_CHANNEL_RESET | DMA_CHANNEL_ABORT | DMA_ACTIVE | DMA_PAUSED);
+    for (int reg = 1; reg < 8; reg++) {
+      dmaReg[reg] = 0;
+    }
+    return true;
+  }
+  if (!(cs & DMA_ACTIVE)) {
+    state.running = false;
+    if (!(cs & DMA_PAUSED)) __sync_fetch_and_or(const_cast<uint32_t *>(&dmaReg[0]), DMA_PAUSED);
+    return false;
+  }
+  if (cs & DMA_PAUSED) __sync_fetch_and_and(const_cast<uint32_t *>(&dmaReg[0]), ~DMA_PAUSED);
+  if (!state.running || dmaReg[1] != state.cbAddr) {  // started, or restarted by the CPU
+    if (dmaReg[1] == 0) return false;
+    loadCB(channel, dmaReg[1]);
+    return true;
+  }
+  bool paced = (state.txInfo & DMA_DEST_DREQ) && DMA_PERMAP(state.txInfo) == PCM_TX;
+  bool progress = false;
+  while (state.remaining >= 4) {
+    if (paced && fifoLevel >= PCM_FIFO_SIZE) {
+      *waiting = true;
+      return progress;
+    }
+    uint32_t * src = reinterpret_cast<uint32_t *>(busToVirtual(state.src));
+    writeWord(state.dest, src ? *src : 0);
+    if (state.txInfo & DMA_SRC_INC) state.src += 4;
+    if (state.txInfo & DMA_DEST_INC) state.dest += 4;
+    state.remaining -= 4;
+    progress = true;
+  }
+  if (state.nextCB == 0) {
+    state.running = false;
+    fifoPrimed = false;  // an empty FIFO is no longer an underrun
+    state.cbAddr = 0;
+    dmaReg[1] = 0;
+    dmaReg[0] = (dmaReg[0] & ~DMA_ACTIVE) | DMA_END_FLAG;
+  } else {
+    loadCB(channel, state.nextCB);
+  }
+  return true;
+}
+
+void Emulator::runEngine() {
+  while (!stopping) {
+    advancePCM();
+    updateClockStatus();
+    updateErrorFlags();
+    bool progress = false;
+    bool waiting = false;
+    for (int channel = 0; channel < DMA_CHANNELS; channel++) {
+      progress |= stepChannel(channel, &waiting);
+    }
+    if (progress) continue;
+    if (waiting && !realTime) {
+      // no real time pacing - the next PCM clock happens right away
+      tick++;
+      if (fifoLevel > 0) fifoLevel--;
+    } else if (waiting) {
+      // wake at least every 100 microseconds, so a paused or aborted channel is seen between PCM clocks
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double next = std::min(secondsOfTick(tick + 1), now.tv_sec + now.tv_nsec / 1e9 + 0.0001);
+      struct timespec wake;
+      wake.tv_sec = static_cast<time_t>(next);
+      wake.tv_nsec = static_cast<long>((next - wake.tv_sec) * 1e9);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    } else {
+      usleep(200);
+    }
+  }
+}
+
+void Emulator::watchPin(uint32_t pin) {
+  WatchedPin watched = { pin, false, 0, 0 };
+  watchedPins.push_back(watched);
+}
+
+std::vector<Emulator::KeyEdge> Emulator::getTimeline() {
+  std::lock_guard<std::mutex> lock(timelineLock);
+  return timeline;
+}
+
+void Emulator::writeTimeline(FILE * file) {
+  std::lock_guard<std::mutex> lock(timelineLock);
+  fprintf(file, "tick,seconds,pin,key,lateness_ms\n");
+  for (KeyEdge & edge : timeline) {
+    fprintf(file, "%llu,%.6f,%d,%s,%.3f\n", static_cast<unsigned long long>(edge.tick), edge.tick / tickRate,
+            edge.pin, edge.keyDown ? "down" : "up", edge.lateness * 1000.0);
+  }
+}
+
+void Emulator::report() {
+  std::lock_guard<std::mutex> lock(timelineLock);
+  double worstLateness = 0.0;
+  double totalLateness = 0.0;
+  for (KeyEdge & edge : timeline) {
+    if (edge.lateness > worstLateness) worstLateness = edge.lateness;
+    totalLateness += edge.lateness;
+  }
+  uint64_t keyDownTicks = 0;
+  for (WatchedPin & watched : watchedPins) {
+    keyDownTicks += watched.keyDownTicks;
+  }
+  LOG_INFO("Emulator: %llu PCM clocks at %.3f Hz, %d key edges, key down for %llu PCM clocks, "
+           "%llu FIFO underruns\n", static_cast<unsigned long long>(tick), tickRate,
+           static_cast<int>(timeline.size()), static_cast<unsigned long long>(keyDownTicks),
+           static_cast<unsigned long long>(underruns));
+  if (watchedPins.size() > 1) {
+    for (WatchedPin & watched : watchedPins) {
+      LOG_INFO("Emulator: GPIO %d key down for %llu PCM clocks\n", watched.pin,
+               static_cast<unsigned long long>(watched.keyDownTicks));
+    }
+  }
+  if (realTime && !timeline.empty()) {
+    LOG_INFO("Emulator: key edge lateness average %.3f ms, worst %.3f ms\n",
+             totalLateness * 1000.0 / timeline.size(), worstLateness * 1000.0);
+  }
+}
+
+Emulator::Emulator(bool realTime, size_t gpuMemorySize) {
+  this->realTime = realTime;
+  this->gpuMemorySize = gpuMemorySize;
+  // reserve address space only - pages are allocated when they are touched
+  peripherals = reinterpret_cast<uint8_t *>(mmap(NULL, PERIPHERAL_SIZE, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  gpuMemory = reinterpret_cast<uint8_t *>(mmap(NULL, gpuMemorySize, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  if (peripherals == MAP_FAILED || gpuMemory == MAP_FAILED) {
+    perror("Emulator failed to reserve memory: ");
+    exit(-1);
+  }
+  freeBlocks[0] = gpuMemorySize;
+  nextHandle = 1;
+
+  // PLLs as the firmware leaves them - PLLD at 500 MHz, both locked
+  *reg(CM_BASE + PLLC_CTRL * 8) = 52 | (1 << 12);
+  *reg(CM_BASE + PLLD_CTRL * 8) = 52 | (1 << 12);
+  *reg(CM_BASE + PLLD_FRAC * 8) = 0x15555;
+  *reg(CM_BASE + PLLD_PER * 8) = 4;
+  *reg(CM_BASE + CM_LOCK * 8 + 4) = CM_LOCK_FLOCKC | CM_LOCK_FLOCKD;
+
+  memset(channels, 0, sizeof(channels));
+  memset(&pcmFlags, 0, sizeof(pcmFlags));
+  memset(debugFlags, 0, sizeof(debugFlags));
+  fifoLevel = 0;
+  underruns = 0;
+  fifoPrimed = false;
+  tickRate = 0.0;
+  tickBaseCount = 0;
+  tick = 0;
+  stopping = false;
+  engine = std::thread(&Emulator::runEngine, this);
+  LOG_INFO("Emulator started, %s PCM clocks\n", realTime ? "real time" : "free running");
+}
+
+Emulator::~Emulator() {
+  stopping = true;
+  engine.join();
+  report();
+  munmap(peripherals, PERIPHERAL_SIZE);
+  munmap(gpuMemory, gpuMemorySize);
+}
@@ -35,10 +35,31 @@ GPIO::GPIO(uint32_t pin, Peripheral * peripheralUtil) {
   gpioModeReg = reinterpret_cast<uint32_t *>(peripheralUtil->mapPeripheralToUserSpace(GPIO_BASE, GPIO_MODE_SIZE));
   this->pin = pin;
   pinModeSettings = gpioModeReg[pin / 10];  // store the current pin mode settings
-  fprintf(stderr, "pin mode settings at offset %d: %8.8x\n", pin / 10, pinModeSettings);
+  LOG_DEBUG("pin mode settings at offset %d: %8.8x\n", pin / 10, pinModeSettings);
+  // pins with a general purpose clock function, see the BCM2835 ARM Peripherals alternate function table
+  const struct {
+    uint32_t pin;
+    int gpclk;
+    uint32_t function;
+  } clockPins[] = {
+    { 4, 0, GPIO_FSEL_ALT0 }, { 5, 1, GPIO_FSEL_ALT0 }, { 6, 2, GPIO_FSEL_ALT0 }, { 20, 0, GPIO_FSEL_ALT5 },
+    { 21, 1, GPIO_FSEL_ALT5 }, { 32, 0, GPIO_FSEL_ALT0 }, { 34, 0, GPIO_FSEL_ALT0 }, { 42, 1, GPIO_FSEL_ALT0 },
+    { 43, 2, GPIO_FSEL_ALT0 }, { 44, 1, GPIO_FSEL_ALT0 }
+  };
+  gpclk = -1;
+  clockFunction = GPIO_FSEL_ALT0;
+  for (auto & clockPin : clockPins) {
+    if (clockPin.pin == pin) {
+      gpclk = clockPin.gpclk;
+      clockFunction = clockPin.function;
+    }
+  }
+  if (gpclk < 0) {
+    LOG_WARN("GPIO %d has no general purpose clock function\n", pin);
+  }
 }
 
 GPIO::~GPIO() {
   gpioModeReg[pin / 10] = pinModeSettings;  // set modes back to initial settings 
-  fprintf(stderr, "GPIO shutting down\n");
+  LOG_INFO("GPIO shutting down\n");
 }
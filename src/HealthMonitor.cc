@@ -0,0 +1,149 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+PCM, DMA and PLL health monitoring
+
+Mark Broihier 2021
+*/
+
+#include "../include/HealthMonitor.h"
+
+void HealthMonitor::record(int anomaly, bool seen, double now) {
+  Anomaly & entry = anomalies[anomaly];
+  if (seen) {
+    if (!entry.present) LOG_WARN("Health: %s\n", entry.help);
+    entry.count++;
+    if (entry.first == 0.0) entry.first = now;
+    entry.last = now;
+  }
+  entry.present = seen;
+}
+
+// An idle PCM runs its FIFO empty, so underruns only count while the DMA channel is active, and the flag left over
+// from idle is cleared when the channel starts.  DMA errors and PLL lock are counted at any time.
+void HealthMonitor::sample() {
+  struct timespec time;
+  clock_gettime(CLOCK_REALTIME, &time);
+  double now = time.tv_sec + time.tv_nsec / 1e9;
+  bool active = dma->dmaIsActive();
+  uint32_t pcmStatus = pcm->getStatus();
+  if (pcmStatus & PCM_CTL_TXERR) {
+    pcm->clearErrors(PCM_CTL_TXERR);
+  }
+  record(PCM_UNDERRUN, active && wasActive && (pcmStatus & PCM_CTL_TXERR), now);
+  uint32_t debug = dma->getDebug();
+  uint32_t debugErrors = DMA_DEBUG_READ_ERROR | DMA_DEBUG_FIFO_ERROR | DMA_DEBUG_READ_LAST_NOT_SET_ERROR;
+  if (debug & debugErrors) {
+    dma->clearErrors(debug & debugErrors);
+  }
+  record(DMA_READ_ERROR, debug & DMA_DEBUG_READ_ERROR, now);
+  record(DMA_FIFO_ERROR, debug & DMA_DEBUG_FIFO_ERROR, now);
+  record(DMA_READ_LAST_NOT_SET_ERROR, debug & DMA_DEBUG_READ_LAST_NOT_SET_ERROR, now);
+  uint32_t lock = clock->clkReg[CM_LOCK].div;
+  record(PLLC_UNLOCKED, !(lock & CM_LOCK_FLOCKC), now);
+  record(PLLD_UNLOCKED, !(lock & CM_LOCK_FLOCKD), now);
+  wasActive = active;
+  samples++;
+}
+
+void HealthMonitor::writeMetrics() {
+  char temporary[256];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE * file = fopen(temporary, "w");
+  if (!file) {
+    LOG_WARN("Health: can't write %s\n", temporary);
+    return;
+  }
+  fprintf(file, "# HELP morse_health_samples_total Samples of the PCM, DMA and PLL flags\n"
+          "# TYPE morse_health_samples_total counter\nmorse_health_samples_total %llu\n",
+          static_cast<unsigned long long>(samples));
+  for (Anomaly & entry : anomalies) {
+    fprintf(file, "# HELP morse_%s_total Samples that saw: %s\n# TYPE morse_%s_total counter\n"
+            "morse_%s_total %llu\n", entry.name, entry.help, entry.name, entry.name,
+            static_cast<unsigned long long>(entry.count));
+    fprintf(file, "# HELP morse_%s_first_seconds Unix time of the first sample that saw it, 0 if none\n"
+            "# TYPE morse_%s_first_seconds gauge\nmorse_%s_first_seconds %.3f\n", entry.name, entry.name,
+            entry.name, entry.first);
+    fprintf(file, "# HELP morse_%s_last_seconds Unix time of the last sample that saw it, 0 if none\n"
+            "# TYPE morse_%s_last_seconds gauge\nmorse_%s_last_seconds %.3f\n", entry.name, entry.name,
+            entry.name, entry.last);
+  }
+  fclose(file);
+  if (rename(temporary, path) != 0) {
+    LOG_WARN("Health: can't rename %s to %s\n", temporary, path);
+  }
+}
+
+void HealthMonitor::run() {
+  uint64_t samplesPerWrite = interval < 1.0 ? static_cast<uint64_t>(1.0 / interval) : 1;
+  while (!stopping) {
+    sample();
+    if (samples % samplesPerWrite == 0) writeMetrics();
+    usleep(interval * 1e6);
+  }
+}
+
+void HealthMonitor::report() {
+  LOG_INFO("Health: %llu samples\n", static_cast<unsigned long long>(samples));
+  for (Anomaly & entry : anomalies) {
+    if (entry.count) {
+      LOG_INFO("Health: %llu samples saw: %s\n", static_cast<unsigned long long>(entry.count), entry.help);
+    }
+  }
+}
+
+HealthMonitor::HealthMonitor(const char * path, double samplesPerSecond, Clock * clock, PCMHW * pcm,
+                             DMAChannel * dma) {
+  const Anomaly table[ANOMALIES] = {
+    { "pcm_tx_underrun", "PCM transmit FIFO underrun (TXERR) while DMA was active", 0, 0.0, 0.0, false },
+    { "dma_read_error", "DMA read error (DEBUG READ_ERROR)", 0, 0.0, 0.0, false },
+    { "dma_fifo_error", "DMA FIFO error (DEBUG FIFO_ERROR)", 0, 0.0, 0.0, false },
+    { "dma_read_last_not_set_error", "DMA AXI read last not set (DEBUG READ_LAST_NOT_SET_ERROR)", 0, 0.0, 0.0,
+      false },
+    { "pllc_unlocked", "PLLC (carrier) not locked (CM_LOCK FLOCKC)", 0, 0.0, 0.0, false },
+    { "plld_unlocked", "PLLD not locked (CM_LOCK FLOCKD)", 0, 0.0, 0.0, false }
+  };
+  for (int anomaly = 0; anomaly < ANOMALIES; anomaly++) {
+    anomalies[anomaly] = table[anomaly];
+  }
+  this->path = path;
+  this->interval = 1.0 / samplesPerSecond;
+  this->clock = clock;
+  this->pcm = pcm;
+  this->dma = dma;
+  stopping = false;
+  sampler = std::thread(&HealthMonitor::run, this);
+  LOG_INFO("Health: sampling %.1f times a second, metrics in %s\n", samplesPerSecond, path);
+}
+
+HealthMonitor::~HealthMonitor() {
+  stopping = true;
+  sampler.join();
+  sample();
+  writeMetrics();
+  report();
+}
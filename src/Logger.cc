@@ -0,0 +1,174 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Lock-free diagnostic logging
+
+Mark Broihier 2021
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/Logger.h"
+
+// created on first use and never destroyed, so it outlives everything that logs while the program exits
+Logger * Logger::instance() {
+  static Logger * logger = new Logger();
+  return logger;
+}
+
+void Logger::log(uint32_t level, const char * format, ...) {
+  Logger * logger = instance();
+  uint64_t position = logger->head.load(std::memory_order_relaxed);
+  Slot * slot;
+  for (;;) {
+    slot = &logger->slots[position & (SLOTS - 1)];
+    int64_t difference = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire) - position);
+    if (difference == 0) {
+      if (logger->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+    } else if (difference < 0) {  // full - the writer hasn't caught up
+      logger->dropped++;
+      return;
+    } else {
+      position = logger->head.load(std::memory_order_relaxed);
+    }
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  slot->record.nanoseconds = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  slot->record.level = level;
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(slot->record.text, TEXT_SIZE, format, arguments);
+  va_end(arguments);
+  if (length < 0) length = 0;
+  if (length >= static_cast<int>(TEXT_SIZE)) {  // truncated - keep the line break
+    length = TEXT_SIZE - 1;
+    slot->record.text[length - 1] = '\n';
+  }
+  slot->record.length = length;
+  slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+// write out the records that are ready - true if there were any
+bool Logger::drain() {
+  bool any = false;
+  std::lock_guard<std::mutex> lock(sinkLock);
+  for (;;) {
+    if (switchPending && tail >= switchPosition) {
+      fflush(output);
+      output = nextOutput;
+      binary = nextBinary;
+      switchPending = false;
+    }
+    Slot * slot = &slots[tail & (SLOTS - 1)];
+    if (slot->sequence.load(std::memory_order_acquire) != tail + 1) break;
+    if (binary) {
+      fwrite(&slot->record, sizeof(Record), 1, output);
+    } else {
+      fwrite(slot->record.text, 1, slot->record.length, output);
+    }
+    slot->sequence.store(tail + SLOTS, std::memory_order_release);
+    tail++;
+    any = true;
+  }
+  if (any) {
+    fflush(output);
+    written.store(tail, std::memory_order_release);
+  }
+  return any;
+}
+
+// poll with a backoff so an idle program (a looping beacon) wakes the writer rarely
+void Logger::writeLoop() {
+  const useconds_t MAXIMUM_BACKOFF = 50000;
+  useconds_t backoff = 1000;
+  while (!stopping) {
+    if (drain()) {
+      backoff = 1000;
+    } else {
+      usleep(backoff);
+      if (backoff < MAXIMUM_BACKOFF) backoff *= 2;
+    }
+  }
+  drain();
+}
+
+// records logged before the call go to the old sink, and the call returns once they have been written
+void Logger::configure(FILE * output, bool binary) {
+  Logger * logger = instance();
+  {
+    std::lock_guard<std::mutex> lock(logger->sinkLock);
+    logger->nextOutput = output;
+    logger->nextBinary = binary;
+    logger->switchPosition = logger->head.load();
+    logger->switchPending = true;
+  }
+  flush();
+}
+
+void Logger::flush() {
+  Logger * logger = instance();
+  uint64_t position = logger->head.load();
+  while (logger->written.load(std::memory_order_acquire) < position && !logger->stopping) {
+    usleep(500);
+  }
+}
+
+uint64_t Logger::getDropped() {
+  return instance()->dropped;
+}
+
+void Logger::shutdown() {
+  Logger * logger = instance();
+  logger->stopping = true;
+  if (logger->writer.joinable()) logger->writer.join();
+  if (logger->dropped) {
+    fprintf(stderr, "Logger: %llu messages dropped, the ring was full\n",
+            static_cast<unsigned long long>(logger->dropped.load()));
+  }
+  if (logger->output != stderr && logger->output != stdout) fclose(logger->output);
+}
+
+Logger::Logger() {
+  for (uint32_t position = 0; position < SLOTS; position++) {
+    slots[position].sequence = position;
+  }
+  head = 0;
+  tail = 0;
+  written = 0;
+  dropped = 0;
+  stopping = false;
+  output = stderr;
+  binary = false;
+  nextOutput = stderr;
+  nextBinary = false;
+  switchPosition = 0;
+  switchPending = false;
+  writer = std::thread(&Logger::writeLoop, this);
+  atexit(shutdown);
+}
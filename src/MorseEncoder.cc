@@ -0,0 +1,237 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Morse code encoder
+
+Mark Broihier 2021
+*/
+
+#include "../include/MorseEncoder.h"
+
+// morse code translation table taken from morse.cpp in https://github.com/F5OEO/rpitx
+#define MORSECODES 37
+
+typedef struct morse_code {
+  uint8_t ch;
+  const char ditDah[8];
+} Morsecode;
+
+static constexpr Morsecode translationTable[MORSECODES]  = {
+                                                            {' ', "    "},
+                                                            {'0', "-----  "},
+                                                            {'1', ".----  "},
+                                                            {'2', "..---  "},
+                                                            {'3', "...--  "},
+                                                            {'4', "....-  "},
+                                                            {'5', ".....  "},
+                                                            {'6', "-....  "},
+                                                            {'7', "--...  "},
+                                                            {'8', "---..  "},
+                                                            {'9', "----.  "},
+                                                            {'A', ".-  "},
+                                                            {'B', "-...  "},
+                                                            {'C', "-.-.  "},
+                                                            {'D', "-..  "},
+                                                            {'E', ".  "},
+                                                            {'F', "..-.  "},
+                                                            {'G', "--.  "},
+                                                            {'H', "....  "},
+                                                            {'I', "..  "},
+                                                            {'J', ".---  "},
+                                                            {'K', "-.-  "},
+                                                            {'L', ".-..  "},
+                                                            {'M', "--  "},
+                                                            {'N', "-.  "},
+                                                            {'O', "---  "},
+                                                            {'P', ".--.  "},
+                                                            {'Q', "--.-  "},
+                                                            {'R', ".-.  "},
+                                                            {'S', "...  "},
+                                                            {'T', "-  "},
+                                                            {'U', "..-  "},
+                                                            {'V', "...-  "},
+                                                            {'W', ".--  "},
+                                                            {'X', "-..-  "},
+                                                            {'Y', "-.--  "},
+                                                            {'Z', "--..  "}
+};
+
+// The translation table expanded at compile time into packed subsymbols for every byte value, so encoding a
+// character is a single table lookup.  A dit is 10, a dah is 1110 and a space in the pattern is 0.
+typedef struct GlyphTable {
+  MorseEncoder::PackedGlyph glyph[256];
+} GlyphTable;
+
+static constexpr MorseEncoder::PackedGlyph packPattern(const char * ditDah) {
+  MorseEncoder::PackedGlyph packed = {0, 0};
+  for (int index = 0; ditDah[index]; index++) {
+    if (ditDah[index] == '.') {
+      packed.subSymbols |= 1u << packed.length;
+      packed.length += 2;
+    } else if (ditDah[index] == '-') {
+      packed.subSymbols |= 7u << packed.length;
+      packed.length += 4;
+    } else {
+      packed.length += 1;
+    }
+  }
+  return packed;
+}
+
+static constexpr GlyphTable buildGlyphTable() {
+  GlyphTable table = {};
+  for (int entry = 0; entry < MORSECODES; entry++) {
+    uint8_t character = translationTable[entry].ch;
+    table.glyph[character] = packPattern(translationTable[entry].ditDah);
+    if (character >= 'A' && character <= 'Z') {
+      table.glyph[character - 'A' + 'a'] = table.glyph[character];
+    }
+  }
+  return table;
+}
+
+static constexpr GlyphTable glyphTable = buildGlyphTable();
+static_assert(glyphTable.glyph['0'].length == MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER,
+              "0 should be the longest character");
+
+char MorseEncoder::characterAt(uint32_t index) {
+  return index < MORSECODES ? translationTable[index].ch : 0;
+}
+
+MorseEncoder::PackedGlyph MorseEncoder::packedGlyph(char character) {
+  return glyphTable.glyph[static_cast<uint8_t>(character)];
+}
+
+bool MorseEncoder::isEncodable(const char * message) {
+  for (const char * character = message; *character; character++) {
+    if (glyphTable.glyph[static_cast<uint8_t>(*character)].length == 0) return false;
+  }
+  return true;
+}
+
+size_t MorseEncoder::encode(const char * message, size_t messageLength, char * encodedMessage,
+                            size_t maxEncodedLength) {
+  size_t encodedMessageIndex = 0;
+  for (size_t index = 0; index < messageLength; index++) {
+    const PackedGlyph & glyph = glyphTable.glyph[static_cast<uint8_t>(message[index])];
+    if (glyph.length == 0 || encodedMessageIndex + glyph.length > maxEncodedLength) {
+      return ENCODING_ERROR;
+    }
+    uint32_t subSymbols = glyph.subSymbols;
+    for (uint32_t bit = 0; bit < glyph.length; bit++) {
+      encodedMessage[encodedMessageIndex++] = (subSymbols >> bit) & 1;
+    }
+  }
+  return encodedMessageIndex;
+}
+
+size_t MorseEncoder::encodeBits(const char * message, size_t messageLength, uint8_t * packedMessage,
+                                size_t maxSubSymbols) {
+  uint64_t accumulator = 0;
+  uint32_t accumulatedBits = 0;
+  size_t subSymbolCount = 0;
+  for (size_t index = 0; index < messageLength; index++) {
+    const PackedGlyph & glyph = glyphTable.glyph[static_cast<uint8_t>(message[index])];
+    if (glyph.length == 0 || subSymbolCount + glyph.length > maxSubSymbols) {
+      return ENCODING_ERROR;
+    }
+    accumulator |= static_cast<uint64_t>(glyph.subSymbols) << accumulatedBits;
+    accumulatedBits += glyph.length;
+    subSymbolCount += glyph.length;
+    while (accumulatedBits >= 8) {
+      *packedMessage++ = accumulator;
+      accumulator >>= 8;
+      accumulatedBits -= 8;
+    }
+  }
+  if (accumulatedBits) {
+    *packedMessage = accumulator;
+  }
+  return subSymbolCount;
+}
+
+size_t MorseEncoder::encodeRuns(const char * message, size_t messageLength, uint32_t * runs, size_t maxRuns) {
+  size_t runCount = 0;
+  for (size_t index = 0; index < messageLength; index++) {
+    const PackedGlyph & glyph = glyphTable.glyph[static_cast<uint8_t>(message[index])];
+    if (glyph.length == 0) {
+      return ENCODING_ERROR;
+    }
+    uint32_t subSymbols = glyph.subSymbols;
+    uint32_t remaining = glyph.length;
+    while (remaining) {
+      uint32_t keyDown = subSymbols & 1 ? RUN_KEY_DOWN : 0;
+      uint32_t runLength = keyDown ? __builtin_ctz(~subSymbols) : subSymbols ? __builtin_ctz(subSymbols) : remaining;
+      if (runLength > remaining) runLength = remaining;
+      // runs continue across character boundaries
+      if (runCount > 0 && (runs[runCount - 1] & RUN_KEY_DOWN) == keyDown) {
+        runs[runCount - 1] += runLength;
+      } else if (runCount < maxRuns) {
+        runs[runCount++] = keyDown | runLength;
+      } else {
+        return ENCODING_ERROR;
+      }
+      subSymbols >>= runLength;
+      remaining -= runLength;
+    }
+  }
+  return runCount;
+}
+
+// encode one character, returns the number of subsymbols or 0 if it doesn't fit - a character that isn't in the
+// table is logged and ends the program
+size_t MorseEncoder::characterToMorse(char character, char * encodedCharacter, size_t maxEncodedLength) {
+  if (packedGlyph(character).length == 0) {
+    LOG_ERROR("Error during encoding - character not found in translation table\n");
+    exit(-1);
+  }
+  size_t encodedSize = encode(&character, 1, encodedCharacter, maxEncodedLength);
+  return encodedSize == ENCODING_ERROR ? 0 : encodedSize;
+}
+
+size_t MorseEncoder::messageToMorse(const char * message, char * encodedMessage, size_t maxEncodedLength) {
+  size_t messageLength = strlen(message);
+  size_t encodedMessageLength = encode(message, messageLength, encodedMessage, maxEncodedLength);
+  if (encodedMessageLength == ENCODING_ERROR) {
+    if (!isEncodable(message)) {
+      LOG_ERROR("Error during encoding - character not found in translation table\n");
+    } else {
+      LOG_ERROR("Error during encoding - not enough space in encoded message buffer\n");
+    }
+    exit(-1);
+  }
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+    char * dump = reinterpret_cast<char *>(malloc(encodedMessageLength + 1));
+    for (size_t index = 0; index < encodedMessageLength; index++) {
+      dump[index] = '0' + encodedMessage[index];
+    }
+    dump[encodedMessageLength] = 0;
+    LOG_DEBUG("Encoded message: %s\n", dump);  // truncated to a log record
+    free(dump);
+  }
+  return encodedMessageLength;
+}
@@ -34,7 +34,7 @@ Mark Broihier 2021
 
 void PCMHW::initPCM() {
   pcmReg->ctrl = PCM_CTL_EN;
-  fprintf(stderr, "PCMHW setup complete\n");
+  LOG_INFO("PCMHW setup complete\n");
 }
 
 // change this to always produce a 1KHz clock which is 1 msec per clock
@@ -42,53 +42,119 @@ void PCMHW::initPCM() {
 // therefore, for 5 words per second rate (250 symbols per min), that is 240 clocks per symbol
 uint32_t PCMHW::setPCMFrequency(uint32_t rate) {
   uint32_t prediv = 9;  // don't know why 10 should be minimum prediv
-  uint32_t frequency = 1000;  // use a 1 KHz (1 msec) timer to clock subsymbols
+  uint32_t frequency = PCM_CLOCK_FREQUENCY;  // use a 1 KHz (1 msec) timer to clock subsymbols
   double pcmFrequencyCtl = 0.0;
-  fprintf(stderr, "symbol rate times upsample = %d\n", frequency);
+  LOG_DEBUG("symbol rate times upsample = %d\n", frequency);
   do {
     prediv++;
     pcmFrequencyCtl = clock->getPLLDFrequency() / static_cast<double>(frequency * prediv);
   } while (prediv < 1000 && ((pcmFrequencyCtl <= 2.0) || (pcmFrequencyCtl >= 4096.0)));
-  fprintf(stderr, "pcmFrequencyCtl = %f\n", pcmFrequencyCtl);
+  LOG_DEBUG("pcmFrequencyCtl = %f\n", pcmFrequencyCtl);
 
   if (prediv > 1000 || pcmFrequencyCtl <= 2.0 || pcmFrequencyCtl >= 4096.0) {
-    fprintf(stderr, "PCM prediv can be no more than 1000 for PCM Frequency Control out of range.\n"
-            "prediv: %d pcpFrequencyCtl: %f\n", prediv, pcmFrequencyCtl);
+    LOG_ERROR("PCM prediv can be no more than 1000 for PCM Frequency Control out of range.\n"
+              "prediv: %d pcpFrequencyCtl: %f\n", prediv, pcmFrequencyCtl);
     exit(-1);
   }
-  fprintf(stderr, "PCM prediv is: %d\n", prediv);
+  LOG_DEBUG("PCM prediv is: %d\n", prediv);
 
   uint32_t pcmDivider = (uint32_t) pcmFrequencyCtl;
   uint32_t pcmDividerFraction = (uint32_t) (4096 * (pcmFrequencyCtl - static_cast<double>(pcmDivider)));
-  fprintf(stderr, "Setting PCM clock controls to %d and %d\n", pcmDivider, pcmDividerFraction);
+  LOG_DEBUG("Setting PCM clock controls to %d and %d\n", pcmDivider, pcmDividerFraction);
+  startPCM(CLK_CTL_SRC(CLK_CTL_SRC_PLLD), CLK_DIV_DIVI(pcmDivider) | pcmDividerFraction, prediv);
+  tickRate = PCM_CLOCK_FREQUENCY;
+  if (clocksPerSubSymbol(rate) && 1200 % rate) {
+    LOG_INFO("%d words per minute is sent at %.3f words per minute - 1200 / rate is rounded down\n", rate,
+             1200.0 / clocksPerSubSymbol(rate));
+  }
+  return clocksPerSubSymbol(rate);
+}
+
+// Pick the frame length and fractional divider of the 19.2 MHz oscillator that come closest to a whole number of
+// PCM clocks per dit.  The oscillator is slow enough for one PCM clock per dit down to about 6 words per minute;
+// below that two or more PCM clocks make up a dit.
+uint32_t PCMHW::setDitFrequency(double wordsPerMinute) {
+  const uint32_t MINIMUM_FRAME_LENGTH = 10;  // as setPCMFrequency's minimum prediv
+  const uint32_t MAXIMUM_FRAME_LENGTH = 1024;
+  double ditRate = wordsPerMinute / 1.2;  // dits per second - PARIS is 50 dits, 1.2 seconds per dit at 1 WPM
+  for (uint32_t clocksPerDit = 1; clocksPerDit <= 1200; clocksPerDit++) {
+    double target = ditRate * clocksPerDit;
+    double bestError = 1.0;
+    double bestRate = 0.0;
+    uint32_t bestFrameLength = 0;
+    uint32_t bestDivider = 0;
+    uint32_t bestFraction = 0;
+    for (uint32_t frameLength = MINIMUM_FRAME_LENGTH; frameLength <= MAXIMUM_FRAME_LENGTH; frameLength++) {
+      double divisor = XOSC_FREQUENCY / (target * frameLength);
+      if (divisor < 2.0 || divisor >= 4096.0) continue;
+      uint32_t divider = divisor;
+      uint32_t fraction = (divisor - divider) * 4096.0 + 0.5;
+      if (fraction == 4096) {
+        divider++;
+        fraction = 0;
+      }
+      if (divider > 4095) continue;
+      double rate = XOSC_FREQUENCY / ((divider + fraction / 4096.0) * frameLength);
+      double error = fabs(rate - target) / target;
+      if (error < bestError) {
+        bestError = error;
+        bestRate = rate;
+        bestFrameLength = frameLength;
+        bestDivider = divider;
+        bestFraction = fraction;
+      }
+    }
+    if (bestFrameLength) {
+      LOG_INFO("Dit synchronous PCM: %d PCM clocks per dit, frame length %d, oscillator divider %d + %d/4096, "
+               "%.4f words per minute (error %+.4f%%)\n", clocksPerDit, bestFrameLength, bestDivider, bestFraction,
+               bestRate / clocksPerDit * 1.2, 100.0 * (bestRate - target) / target);
+      // MASH 1 is needed for the fraction to take effect
+      startPCM(CLK_CTL_SRC(CLK_CTL_SRC_OSC) | CLK_CTL_MASH(bestFraction ? 1 : 0),
+               CLK_DIV_DIVI(bestDivider) | CLK_DIV_DIVF(bestFraction), bestFrameLength);
+      tickRate = bestRate;
+      return clocksPerDit;
+    }
+  }
+  LOG_ERROR("No PCM clock setting for %.3f words per minute\n", wordsPerMinute);
+  exit(-1);
+}
+
+// program the PCM clock and frame length (one DREQ per frame when a FIFO slot is free) and start the transmitter
+void PCMHW::startPCM(uint32_t control, uint32_t divider, uint32_t frameLength) {
   // kill the clock if busy
   if (clock->clkReg[PCMCLK].ctrl & CLK_CTL_BUSY) {
-    do {
-      clock->clkReg[PCMCLK].ctrl = BCM_PASSWD | CLK_CTL_KILL;
-    } while (clock->clkReg[PCMCLK].ctrl & CLK_CTL_BUSY);
+    clock->clkReg[PCMCLK].ctrl = BCM_PASSWD | CLK_CTL_KILL;
+    Clock::waitForRegister(&clock->clkReg[PCMCLK].ctrl, CLK_CTL_BUSY, 0, CLK_CTL_BUSY_TIMEOUT, "PCM clock stop");
   }
-  fprintf(stderr, "PCM clock stopped, changing source to PLLD\n");
+  LOG_DEBUG("PCM clock stopped, changing source to %s\n",
+            (control & 0xf) == CLK_CTL_SRC_OSC ? "the oscillator" : "PLLD");
   // set PCM dividers and fractions
-  clock->clkReg[PCMCLK].div = BCM_PASSWD | CLK_DIV_DIVI(pcmDivider) | pcmDividerFraction;
+  clock->clkReg[PCMCLK].div = BCM_PASSWD | divider;
   // reenable the clock
-  clock->clkReg[PCMCLK].ctrl = BCM_PASSWD | CLK_CTL_SRC(CLK_CTL_SRC_PLLD) | CLK_CTL_ENAB;
+  clock->clkReg[PCMCLK].ctrl = BCM_PASSWD | control;
+  clock->clkReg[PCMCLK].ctrl = BCM_PASSWD | control | CLK_CTL_ENAB;
+  Clock::waitForRegister(&clock->clkReg[PCMCLK].ctrl, CLK_CTL_BUSY, CLK_CTL_BUSY, CLK_CTL_BUSY_TIMEOUT,
+                         "PCM clock start");
+  clock->endPhase("PCM clock divider");
 
   pcmReg->transmitter = 1 << 30;  // 1 channel, 8 bits
-  usleep(100);
-  pcmReg->mode = (prediv - 1) << 10;  // prediv clock by prediv - 1 as per HW documentation
-  usleep(100);
-  pcmReg->ctrl |= 1 << 4 | 1 << 3;  // clear fifos
-  usleep(100);
+  pcmReg->mode = (frameLength - 1) << 10;  // frame length is the field plus one as per HW documentation
+  pcmReg->ctrl |= PCM_CTL_RXCLR | PCM_CTL_TXCLR;  // clear fifos
+  // the clears take effect within two PCM clocks - SYNC reads back once two PCM clocks have passed
+  pcmReg->ctrl |= PCM_CTL_SYNC;
+  Clock::waitForRegister(&pcmReg->ctrl, PCM_CTL_SYNC, PCM_CTL_SYNC, PCM_SYNC_TIMEOUT, "PCM FIFO clear");
+  pcmReg->ctrl &= ~PCM_CTL_SYNC;
   pcmReg->dmaReq = 0x40 << 24 | 0x40 << 8;  // DMA Request when one slot is free
-  usleep(100);
-  pcmReg->ctrl |= 1 << 9;  // enable DMA
-  usleep(100);
-  pcmReg->ctrl |= 1 << 2;  // Start transmit of PCM
-
-  // rate is words per min which turns out to be standardized to 0.120 seconds / subsymbol for 10 words per min
-  // To get calculate the clocks per subsymbol for a rate we do this:
-  // 120 clocks/subsymbol * 10 words/min / rate words/min = clocks per subsymbol
-  return ( 1200 / rate );
+  pcmReg->ctrl |= PCM_CTL_DMAEN;  // enable DMA
+  pcmReg->ctrl |= PCM_CTL_TXON;  // Start transmit of PCM
+  clock->endPhase("PCM FIFO clear and start");
+}
+
+// error flags are cleared by writing 1 - the control fields are written back as they are, with no FIFO clear and
+// only the flags being cleared set
+void PCMHW::clearErrors(uint32_t errors) {
+  uint32_t control = pcmReg->ctrl & ~(PCM_CTL_TXCLR | PCM_CTL_RXCLR | PCM_CTL_TXERR | PCM_CTL_RXERR | PCM_CTL_STATUS);
+  pcmReg->ctrl = control | errors;
 }
 
   PCMHW::PCMHW(Clock * clock, Peripheral * peripheralUtil) {
@@ -98,5 +164,5 @@ uint32_t PCMHW::setPCMFrequency(uint32_t rate) {
 }
 
 PCMHW::~PCMHW() {
-  fprintf(stderr, "Shutting down PCMHW\n");
+  LOG_INFO("Shutting down PCMHW\n");
 }
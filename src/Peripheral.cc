@@ -31,66 +31,80 @@ Mark Broihier 2021
 */
 
 #include "../include/Peripheral.h"
+#include "../include/PiBackend.h"
 
 void * Peripheral::mapPeripheralToUserSpace(uint32_t addr, size_t size) {
-  int mem_fd;
-  // Check mem(4) about /dev/mem
-  if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
-    perror("Failed to open /dev/mem: ");
-    exit(-1);
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint32_t firstPage = addr & ~(PAGE_SIZE - 1);
+  size_t pagesSize = (addr + size - firstPage + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+  // the mapping that starts at or before the first page
+  uint8_t * result = 0;
+  auto mapping = mappings.upper_bound(firstPage);
+  if (mapping != mappings.begin()) {
+    mapping--;
+    if (firstPage + pagesSize <= mapping->first + mapping->second.size) {
+      result = mapping->second.peripheralAddress + (addr - mapping->first);
+      reuseCount++;
+    }
   }
-
-  uint32_t *result = reinterpret_cast<uint32_t *>(mmap(
-                                                       NULL,
-                                                       size,
-                                                       PROT_READ | PROT_WRITE,
-                                                       MAP_SHARED,
-                                                       mem_fd,
-                                                       PERI_PHYS_BASE + addr));
-
-  close(mem_fd);
-
-  fprintf(stderr, "mmap to address %8.8x\n", addr);
-  if (result == MAP_FAILED) {
-    perror("mmap error: ");
-    exit(-1);
+  if (!result) {
+    Mapping newMapping;
+    newMapping.peripheralAddress =
+      reinterpret_cast<uint8_t *>(hw->mapPhysical(PERI_PHYS_BASE + firstPage, pagesSize));
+    newMapping.size = pagesSize;
+    // a larger mapping of the same first page replaces the smaller one in the index - the smaller one stays
+    // mapped for its users
+    auto replaced = mappings.find(firstPage);
+    if (replaced != mappings.end()) {
+      superseded.push_back(replaced->second);
+    }
+    mappings[firstPage] = newMapping;
+    result = newMapping.peripheralAddress + (addr - firstPage);
+    mapCount++;
+    LOG_DEBUG("mmap to address %8.8x\n", addr);
   }
-
-  if (!listOfMappings) {
-    listOfMappings = reinterpret_cast<Mappings *>(malloc(sizeof(Mappings)));
-    listOfMappingsHead = listOfMappings;
-  } else {
-    listOfMappings->nextMap = reinterpret_cast<Mappings *>(malloc(sizeof(Mappings)));
-    listOfMappings = listOfMappings->nextMap;
-  }
-  listOfMappings->offsetFromBase = addr;
-  listOfMappings->peripheralAddress = result;
-  listOfMappings->size = size;
-  listOfMappings->nextMap = 0;
-
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  mapSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
   return result;
 }
 
 void Peripheral::unmapPeripherals() {
-  Mappings * toFree = 0;
-  while (listOfMappingsHead) {
-    fprintf(stderr, "Freeing memory related to peripheral offset: %8.8x\n", listOfMappingsHead->offsetFromBase);
-    munmap(listOfMappingsHead->peripheralAddress, listOfMappingsHead->size);
-    toFree = listOfMappingsHead;
-    listOfMappingsHead = listOfMappingsHead->nextMap;
-    free(toFree);
+  for (auto & mapping : mappings) {
+    LOG_DEBUG("Freeing memory related to peripheral offset: %8.8x\n", mapping.first);
+    hw->unmapPhysical(mapping.second.peripheralAddress, mapping.second.size);
+    unmapCount++;
   }
-  listOfMappingsHead = 0;
+  for (Mapping & mapping : superseded) {
+    hw->unmapPhysical(mapping.peripheralAddress, mapping.size);
+    unmapCount++;
+  }
+  mappings.clear();
+  superseded.clear();
+}
+
+void Peripheral::reportMappings() {
+  LOG_INFO("Peripheral mappings: %d mapped, %d reused, %d unmapped, %.3f ms spent mapping\n", mapCount,
+           reuseCount, unmapCount, mapSeconds * 1000.0);
 }
 
-Peripheral::Peripheral() {
-  PERI_PHYS_BASE = bcm_host_get_peripheral_address();
-  listOfMappings = 0;
+Peripheral::Peripheral() : Peripheral(new PiBackend()) {
+}
+
+Peripheral::Peripheral(HWBackend * backend) {
+  hw = backend;
+  PERI_PHYS_BASE = hw->peripheralBase();
+  mapCount = 0;
+  reuseCount = 0;
+  unmapCount = 0;
+  mapSeconds = 0.0;
 }
 
 Peripheral::~Peripheral() {
-  fprintf(stderr, "Shutting down Peripheral\n");
-  if (listOfMappingsHead) {
-    unmapPeripherals();
-  }
+  LOG_INFO("Shutting down Peripheral\n");
+  unmapPeripherals();
+  reportMappings();
+  delete hw;
 }
@@ -0,0 +1,82 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Raspberry Pi hardware access through /dev/mem and the VideoCore mailbox
+
+Mark Broihier 2021
+*/
+
+#include "../include/PiBackend.h"
+
+uint32_t PiBackend::peripheralBase() {
+#ifdef HAVE_BCM_HOST
+  return bcm_host_get_peripheral_address();
+#else
+  // without bcm_host, read the address from the device tree the way bcm_host does
+  uint32_t address = 0x20000000;  // original Pi
+  unsigned char ranges[12];
+  FILE * file = fopen("/proc/device-tree/soc/ranges", "rb");
+  if (file) {
+    if (fread(ranges, 1, sizeof(ranges), file) == sizeof(ranges)) {
+      address = ranges[4] << 24 | ranges[5] << 16 | ranges[6] << 8 | ranges[7];
+      if (address == 0) {
+        address = ranges[8] << 24 | ranges[9] << 16 | ranges[10] << 8 | ranges[11];
+      }
+    }
+    fclose(file);
+  }
+  return address;
+#endif
+}
+
+void * PiBackend::mapPhysical(uint32_t physicalAddress, size_t size) {
+  // Check mem(4) about /dev/mem
+  if (memFD < 0 && (memFD = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
+    perror("Failed to open /dev/mem: ");
+    exit(-1);
+  }
+
+  void * result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memFD, physicalAddress);
+
+  if (result == MAP_FAILED) {
+    perror("mmap error: ");
+    exit(-1);
+  }
+  return result;
+}
+
+void PiBackend::unmapPhysical(void * address, size_t size) {
+  munmap(address, size);
+}
+
+PiBackend::PiBackend() {
+  memFD = -1;
+}
+
+PiBackend::~PiBackend() {
+  if (memFD >= 0) close(memFD);
+}
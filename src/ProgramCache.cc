@@ -0,0 +1,119 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Compiled control block program cache
+
+Mark Broihier 2021
+*/
+
+#include "../include/ProgramCache.h"
+
+ProgramCache::ProgramCache(const char * directory) {
+  snprintf(this->directory, sizeof(this->directory), "%s", directory);
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    LOG_WARN("Program cache: can't create %s\n", directory);
+  }
+}
+
+ProgramCache::~ProgramCache() {
+  report();
+}
+
+// FNV-1a over the description and the timing parameters
+uint64_t ProgramCache::key(const char * description, uint32_t clocksPerSubSymbol, double tickRate, uint32_t pin) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  auto add = [&hash](const void * data, size_t size) {
+    for (size_t index = 0; index < size; index++) {
+      hash = (hash ^ reinterpret_cast<const uint8_t *>(data)[index]) * 0x100000001b3ULL;
+    }
+  };
+  add(description, strlen(description));
+  add(&clocksPerSubSymbol, sizeof(clocksPerSubSymbol));
+  add(&tickRate, sizeof(tickRate));
+  add(&pin, sizeof(pin));
+  uint32_t version = VERSION;
+  add(&version, sizeof(version));
+  return hash;
+}
+
+void ProgramCache::fileName(uint64_t key, char * name, size_t size) {
+  snprintf(name, size, "%s/%016llx.cbp", directory, static_cast<unsigned long long>(key));
+}
+
+bool ProgramCache::load(uint64_t key, const char * description, std::vector<uint8_t> * image) {
+  char name[300];
+  fileName(key, name, sizeof(name));
+  FILE * file = fopen(name, "r");
+  bool hit = false;
+  if (file) {
+    FileHeader header;
+    std::vector<char> stored;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == MAGIC && header.version == VERSION &&
+        header.key == key && header.descriptionSize == strlen(description)) {
+      stored.resize(header.descriptionSize);
+      image->resize(header.imageSize);
+      hit = fread(stored.data(), 1, stored.size(), file) == stored.size() &&
+        memcmp(stored.data(), description, stored.size()) == 0 &&
+        fread(image->data(), 1, image->size(), file) == image->size();
+    }
+    fclose(file);
+  }
+  if (hit) {
+    hits++;
+  } else {
+    misses++;
+  }
+  return hit;
+}
+
+void ProgramCache::store(uint64_t key, const char * description, const std::vector<uint8_t> & image) {
+  char name[300];
+  char temporary[310];
+  fileName(key, name, sizeof(name));
+  snprintf(temporary, sizeof(temporary), "%s.tmp", name);
+  FILE * file = fopen(temporary, "w");
+  if (!file) {
+    LOG_WARN("Program cache: can't write %s\n", temporary);
+    return;
+  }
+  FileHeader header = { MAGIC, VERSION, key, static_cast<uint32_t>(strlen(description)),
+                        static_cast<uint32_t>(image.size()) };
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(description, 1, header.descriptionSize, file) == header.descriptionSize &&
+    fwrite(image.data(), 1, image.size(), file) == image.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary, name) != 0) {
+    LOG_WARN("Program cache: can't write %s\n", name);
+    unlink(temporary);
+    return;
+  }
+  stores++;
+}
+
+void ProgramCache::report() {
+  LOG_INFO("Program cache: %d hits, %d misses, %d programs stored in %s\n", hits, misses, stores, directory);
+}
@@ -0,0 +1,87 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Shared memory progress page
+
+Mark Broihier 2021
+*/
+
+#include "../include/StatsPage.h"
+
+void StatsPage::publish(const Progress & progress) {
+  uint32_t sequence = page->sequence.load(std::memory_order_relaxed);
+  page->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  page->progress = progress;
+  page->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool StatsPage::read(Progress * progress) {
+  for (int attempt = 0; attempt < 100; attempt++) {
+    uint32_t before = page->sequence.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    *progress = page->progress;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (page->sequence.load(std::memory_order_relaxed) == before) return true;
+  }
+  return false;
+}
+
+StatsPage::StatsPage(const char * name, bool owner) {
+  snprintf(this->name, sizeof(this->name), "/%s", name);
+  this->owner = owner;
+  int fd = shm_open(this->name, owner ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+  if (fd < 0) {
+    perror("Failed to open the shared memory stats page: ");
+    exit(-1);
+  }
+  if (owner && ftruncate(fd, sizeof(Page)) < 0) {
+    perror("Failed to size the shared memory stats page: ");
+    exit(-1);
+  }
+  page = reinterpret_cast<Page *>(mmap(NULL, sizeof(Page), owner ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                                       fd, 0));
+  close(fd);
+  if (page == MAP_FAILED) {
+    perror("Failed to map the shared memory stats page: ");
+    exit(-1);
+  }
+  if (owner) {
+    page->sequence = 0;
+    page->version = VERSION;
+    Progress idle = { 0, 0, 0, 0, 0.0, 0.0, 0.0 };
+    publish(idle);
+  } else if (page->version != VERSION) {
+    LOG_ERROR("Stats page %s has version %d, expected %d\n", this->name, page->version, VERSION);
+    exit(-1);
+  }
+}
+
+StatsPage::~StatsPage() {
+  munmap(page, sizeof(Page));
+  if (owner) shm_unlink(name);
+}
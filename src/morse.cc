@@ -29,113 +29,68 @@ Mark Broihier
 */
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <signal.h>
+#include <string>
 
 #include "../include/Clock.h"
+#include "../include/Daemon.h"
 #include "../include/DMAChannel.h"
+#include "../include/Emulator.h"
 #include "../include/GPIO.h"
+#include "../include/HealthMonitor.h"
+#include "../include/Logger.h"
 #include "../include/Peripheral.h"
 #include "../include/PCMHW.h"
+#include "../include/PiBackend.h"
+#include "../include/ProgramCache.h"
+#include "../include/StatsPage.h"
 #include "../include/mailbox.h"
+#include "../include/MorseEncoder.h"
 
-// morse code translation table taken from morse.cpp in https://github.com/F5OEO/rpitx
-#define MORSECODES 37
-
-typedef struct morse_code {
-  uint8_t ch;
-  const char ditDah[8];
-} Morsecode;
-
-const Morsecode translationTable[]  = {
-                                       {' ', "    "},
-                                       {'0', "-----  "},
-                                       {'1', ".----  "},
-                                       {'2', "..---  "},
-                                       {'3', "...--  "},
-                                       {'4', "....-  "},
-                                       {'5', ".....  "},
-                                       {'6', "-....  "},
-                                       {'7', "--...  "},
-                                       {'8', "---..  "},
-                                       {'9', "----.  "},
-                                       {'A', ".-  "},
-                                       {'B', "-...  "},
-                                       {'C', "-.-.  "},
-                                       {'D', "-..  "},
-                                       {'E', ".  "},
-                                       {'F', "..-.  "},
-                                       {'G', "--.  "},
-                                       {'H', "....  "},
-                                       {'I', "..  "},
-                                       {'J', ".---  "},
-                                       {'K', "-.-  "},
-                                       {'L', ".-..  "},
-                                       {'M', "--  "},
-                                       {'N', "-.  "},
-                                       {'O', "---  "},
-                                       {'P', ".--.  "},
-                                       {'Q', "--.-  "},
-                                       {'R', ".-.  "},
-                                       {'S', "...  "},
-                                       {'T', "-  "},
-                                       {'U', "..-  "},
-                                       {'V', "...-  "},
-                                       {'W', ".--  "},
-                                       {'X', "-..-  "},
-                                       {'Y', "-.--  "},
-                                       {'Z', "--..  "}
-};
-
-size_t messageToMorse(const char * message, char * encodedMessage, size_t maxEncodedLength) {
-  size_t messageLength = strlen(message);
-  uint32_t encodedMessageIndex = 0;
-  bool found;
-  for (uint32_t index = 0; index < messageLength; index++) {
-    char workingCharacter = toupper(message[index]);
-    found = false;
-    for (uint32_t tableIndex = 0; tableIndex < MORSECODES; tableIndex++) {
-      if (workingCharacter == translationTable[tableIndex].ch) {
-        const char * characterPattern = translationTable[tableIndex].ditDah;
-        uint32_t patternSize = strlen(characterPattern);
-        found = true;
-        if (encodedMessageIndex + 4*patternSize < maxEncodedLength) {
-          for (uint32_t patternIndex = 0; patternIndex < patternSize; patternIndex++) {
-            if (characterPattern[patternIndex] == '.') {
-              encodedMessage[encodedMessageIndex++] = 1;
-              encodedMessage[encodedMessageIndex++] = 0;
-            } else if (characterPattern[patternIndex] == '-') {
-              encodedMessage[encodedMessageIndex++] = 1;
-              encodedMessage[encodedMessageIndex++] = 1;
-              encodedMessage[encodedMessageIndex++] = 1;
-              encodedMessage[encodedMessageIndex++] = 0;
-            } else {
-              encodedMessage[encodedMessageIndex++] = 0;
-            }
-          }
-        } else {
-          fprintf(stderr, "Error during encoding - not enough space in encoded message buffer\n");
-          exit(-1);
-        }
-      }
-    }
-    if (!found) {
-      fprintf(stderr, "Error during encoding - character not found in translation table\n");
-      exit(-1);
-    }
+// input for streaming mode - text is read without blocking so the DMA ring producer never stalls
+typedef struct StreamInput {
+  int fd;
+} StreamInput;
+
+int readSubSymbols(char * subSymbols, size_t maxSize, void * context) {
+  StreamInput * input = reinterpret_cast<StreamInput *>(context);
+  struct pollfd pfd = { input->fd, POLLIN, 0 };
+  if (poll(&pfd, 1, 0) <= 0) {
+    return 0;
   }
-  fprintf(stdout, "Encoded message:\n");
-  for (uint32_t index = 0; index < encodedMessageIndex; index++) {
-    fprintf(stdout, "%1.1d", encodedMessage[index]);
+  char text[64];
+  size_t maxCharacters = maxSize / MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+  ssize_t count = read(input->fd, text, maxCharacters < sizeof(text) ? maxCharacters : sizeof(text));
+  if (count <= 0) {
+    return -1;
   }
-  fprintf(stdout, "\n");
-  return(encodedMessageIndex);
+  for (ssize_t index = 0; index < count; index++) {
+    if (isspace(text[index])) text[index] = ' ';  // line breaks and tabs are word spaces
+  }
+  size_t encodedSize = MorseEncoder::encode(text, count, subSymbols, maxSize);
+  if (encodedSize == MorseEncoder::ENCODING_ERROR) {
+    LOG_ERROR("Error during encoding - character not found in translation table\n");
+    return -1;
+  }
+  return encodedSize;
 }
 
-bool exitLoop = false;
+volatile sig_atomic_t exitLoop = false;
+DMAChannel * volatile abortChannel = 0;  // the channel an interrupt stops at once
+volatile sig_atomic_t finishCycle = false;  // a looping program is let finish its cycle instead
 
+// only async signal safe calls here - the message is written with write, and the channel's abort spins on registers
+// and DMA memory with clock_gettime
 void sigint_handler(int signo) {
   if (signo == SIGINT) {
-    fprintf(stdout, "\nUser termination request\n");
+    static const char NOTICE[] = "\nUser termination request\n";
+    if (write(STDOUT_FILENO, NOTICE, sizeof(NOTICE) - 1) < 0) {
+      // nothing to be done about it here
+    }
+    if (abortChannel && !finishCycle) abortChannel->abortProgram();
     exitLoop = true;
   }
 }
@@ -144,36 +99,339 @@ int main(int argc, char ** argv) {
   uint32_t frequency = 0;
   uint32_t symbolRate = 0;
   const char * message = 0;
+  bool streamMode = false;
+  bool glyphMode = false;
+  bool emulate = false;
+  bool beaconMode = false;
+  bool outputsMode = false;
+  bool ditSynchronous = false;
+  bool queueMode = false;
+  double loopGap = -1.0;  // seconds between repeats of a looping program, negative when not looping
+  const char * socketPath = 0;
+  const char * statsName = 0;
+  const char * healthPath = 0;
+  double samplesPerSecond = 10.0;
+  const char * cacheDirectory = 0;
+  double slot = -1.0;  // seconds the program must fit in when it is verified first, negative when not verified
+  int opt;
 
   signal(SIGINT, sigint_handler);
 
-  if (argc != 4) {
-    fprintf(stdout, "Usage: sudo ./morse <frequency> <transmission rate> <message - in quotes>\n");
+  while ((opt = getopt(argc, argv, "esgbmtqd:p:l:L:H:r:v:c:")) != -1) {
+    switch (opt) {
+      case 'e':
+        emulate = true;
+        break;
+      case 's':
+        streamMode = true;
+        break;
+      case 'g':
+        glyphMode = true;
+        break;
+      case 'b':
+        beaconMode = true;
+        break;
+      case 'm':
+        outputsMode = true;
+        break;
+      case 't':
+        ditSynchronous = true;
+        break;
+      case 'q':
+        queueMode = true;
+        break;
+      case 'd':
+        socketPath = optarg;
+        break;
+      case 'p':
+        statsName = optarg;
+        break;
+      case 'l':
+        loopGap = atof(optarg);
+        break;
+      case 'H':
+        healthPath = optarg;
+        break;
+      case 'r':
+        samplesPerSecond = atof(optarg);
+        break;
+      case 'v':
+        slot = atof(optarg);
+        break;
+      case 'c':
+        cacheDirectory = optarg;
+        break;
+      case 'L': {
+        FILE * logFile = fopen(optarg, "w");
+        if (!logFile) {
+          perror("Failed to open log file: ");
+          exit(-1);
+        }
+        Logger::configure(logFile, true);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  bool argumentsValid = socketPath ? argc - optind == 2 :
+    streamMode || queueMode ? argc - optind == 2 || argc - optind == 3 :
+    beaconMode ? argc - optind >= 3 && (argc - optind - 3) % 2 == 0 :
+    outputsMode ? argc - optind >= 4 && (argc - optind - 1) % 3 == 0 : argc - optind == 3;
+  if (ditSynchronous && socketPath) {
+    argumentsValid = false;  // the daemon changes rate per request, which needs the 1 KHz PCM clock
+  }
+  if (samplesPerSecond <= 0.0) {
+    argumentsValid = false;
+  }
+  if (!argumentsValid) {
+    fprintf(stdout, "Usage: sudo ./morse [-e] [-g] <frequency> <transmission rate> <message - in quotes>\n"
+            "       sudo ./morse [-e] -s <frequency> <transmission rate> [text file - default is stdin]\n"
+            "       sudo ./morse [-e] -q <frequency> <transmission rate> [file, a message per line, default stdin]\n"
+            "       sudo ./morse [-e] -d <socket path> <frequency> <transmission rate>\n"
+            "       sudo ./morse [-e] -b <frequency> <transmission rate> <message> [<frequency> <message>]...\n"
+            "       sudo ./morse [-e] -m <transmission rate> <pin> <frequency> <message>\n"
+            "                             [<pin> <frequency> <message>]...\n"
+            "       -e runs on the software emulator instead of the hardware\n"
+            "       -t paces DMA at one PCM clock per dit (fractional rates allowed) instead of 1 KHz\n"
+            "       -l <gap seconds> repeats the message (or beacon, or outputs) until interrupted\n"
+            "       -v <slot seconds> checks the program first, and doesn't send it if it is invalid or doesn't\n"
+            "                         fit in the slot (0 for any length)\n"
+            "       -c <directory> keeps compiled messages and beacons in <directory> to send them again\n"
+            "                      without compiling\n"
+            "       -L <file> writes diagnostics to <file> as binary Logger::Record records instead of to stderr\n"
+            "       -p <name> publishes transmission progress in shared memory /dev/shm/<name>\n"
+            "       -H <file> samples PCM, DMA and PLL health and writes metrics to <file>\n"
+            "       -r <samples per second> sets the health sampling rate (default 10)\n");
     exit(-1);
   }
-  frequency = atoi(argv[1]);
-  symbolRate = atoi(argv[2]);
-  message = argv[3];
+  // with several outputs, the first (pin, frequency, message) triple is the GP0 output the clock is tuned for
+  uint32_t pin = outputsMode ? atoi(argv[optind + 1]) : 4;  // Use pin GPIO 4 (BCM) unless told otherwise
+  frequency = atoi(argv[outputsMode ? optind + 2 : optind]);
+  double wordsPerMinute = atof(argv[outputsMode ? optind : optind + 1]);
+  symbolRate = wordsPerMinute;
+  message = outputsMode ? argv[optind + 3] : argc - optind == 3 ? argv[optind + 2] : "-";
 
-  Peripheral peripheralUtil;  //  create an object to reference peripherals
-  GPIO gpio(4, &peripheralUtil);  // Use pin GPIO 4 (BCM)
+  Emulator * emulator = emulate ? new Emulator() : 0;
+  if (emulator) {
+    for (int argument = optind + 1; argument < (outputsMode ? argc : optind + 2); argument += 3) {
+      emulator->watchPin(outputsMode ? atoi(argv[argument]) : pin);
+    }
+  }
+  //  create an object to reference peripherals - it owns the backend
+  Peripheral peripheralUtil(emulator ? static_cast<HWBackend *>(emulator) : new PiBackend());
+  GPIO gpio(pin, &peripheralUtil);
+  if (gpio.gpclk != 0) {
+    LOG_ERROR("GPIO %d is not a GPCLK0 output (GPIO 4, 20, 32 or 34)\n", pin);
+    exit(-1);
+  }
   Clock clock(frequency, &gpio, &peripheralUtil);
   PCMHW pcm(&clock, &peripheralUtil);
-  uint32_t clocksPerSubSymbol = pcm.setPCMFrequency(symbolRate);
+  uint32_t clocksPerSubSymbol = ditSynchronous ? pcm.setDitFrequency(wordsPerMinute) :
+    pcm.setPCMFrequency(symbolRate);
+  clock.reportPhases();
+  StatsPage * statsPage = statsName ? new StatsPage(statsName, true) : 0;
+
+  if (socketPath) {
+    DMAChannel dma(5, &gpio, &peripheralUtil);
+    dma.setTickRate(pcm.getTickRate());
+    dma.publishProgress(statsPage);
+    HealthMonitor * health = healthPath ? new HealthMonitor(healthPath, samplesPerSecond, &clock, &pcm, &dma) : 0;
+    Daemon daemon(socketPath, &clock, &dma);
+    abortChannel = &dma;
+    daemon.run(&exitLoop);
+    abortChannel = 0;
+    delete health;
+    delete statsPage;
+    return 0;
+  }
+
+  if (streamMode) {
+    StreamInput input;
+    input.fd = strcmp(message, "-") == 0 ? STDIN_FILENO : open(message, O_RDONLY);
+    if (input.fd < 0) {
+      perror("Failed to open message file: ");
+      exit(-1);
+    }
+    const uint32_t RING_SLOTS = 256;
+    DMAChannel dma(RING_SLOTS, 5, &gpio, &peripheralUtil);
+    dma.setTickRate(pcm.getTickRate());
+    HealthMonitor * health = healthPath ? new HealthMonitor(healthPath, samplesPerSecond, &clock, &pcm, &dma) : 0;
+    abortChannel = &dma;
+    dma.streamStart(readSubSymbols, &input, clocksPerSubSymbol);
+    fprintf(stdout, "Message streaming started.\n");
+    while (dma.streamIsRunning() && !exitLoop) {
+      sleep(1.0);
+    }
+    abortChannel = 0;
+    dma.streamStop();
+    delete health;
+    if (input.fd != STDIN_FILENO) close(input.fd);
+    return 0;
+  }
+
+  if (queueMode) {
+    // each line is a message, sent right after the one before it with no gap
+    FILE * input = strcmp(message, "-") == 0 ? stdin : fopen(message, "r");
+    if (!input) {
+      perror("Failed to open message file: ");
+      exit(-1);
+    }
+    DMAChannel dma(5, &gpio, &peripheralUtil);
+    dma.setTickRate(pcm.getTickRate());
+    HealthMonitor * health = healthPath ? new HealthMonitor(healthPath, samplesPerSecond, &clock, &pcm, &dma) : 0;
+    abortChannel = &dma;
+    char line[1024];
+    while (!exitLoop && fgets(line, sizeof(line) - 1, input)) {
+      line[strcspn(line, "\r\n")] = 0;
+      if (!line[0]) continue;
+      strcat(line, " ");  // a word space between messages
+      size_t queuedSize = strlen(line) * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+      char * subSymbols = reinterpret_cast<char *>(malloc(queuedSize));
+      queuedSize = MorseEncoder::encode(line, strlen(line), subSymbols, queuedSize);
+      if (queuedSize == MorseEncoder::ENCODING_ERROR) {
+        LOG_WARN("Error during encoding - character not found in translation table, message skipped\n");
+      } else {
+        dma.queueMessage(subSymbols, queuedSize, clocksPerSubSymbol);
+      }
+      free(subSymbols);
+    }
+    while (!exitLoop && !dma.waitForCompletion(0.1)) {
+    }
+    abortChannel = 0;
+    dma.reportQueue();
+    delete health;
+    if (input != stdin) fclose(input);
+    return 0;
+  }
 
   size_t messageLen = strlen(message) * 7 * 4;  // 7 dit dahs, 4 bytes per dit dah (maximum)
   char * transmissionBuffer = reinterpret_cast<char *>(malloc(messageLen));
-  messageLen = messageToMorse(message, transmissionBuffer, messageLen);
-  DMAChannel dma(transmissionBuffer, messageLen, clocksPerSubSymbol, 5, &gpio, &peripheralUtil);
-  dma.dmaStart();
-  fprintf(stdout, "Message transmission started.\n");
-  int forceTermination = 0;
-  int const MAXIMUM_TRANSMISSION_TIME = 600;  // 10 minutes
-  while (dma.dmaIsRunning() && !exitLoop) {
-    fprintf(stdout, "DMA Channel is still running/message still being sent, poll cycle %d\n", forceTermination);
-    sleep(1.0);
-    if (forceTermination++ > MAXIMUM_TRANSMISSION_TIME) break;
+  DMAChannel dma(5, &gpio, &peripheralUtil);
+  dma.setTickRate(pcm.getTickRate());
+  dma.publishProgress(statsPage);
+  HealthMonitor * health = healthPath ? new HealthMonitor(healthPath, samplesPerSecond, &clock, &pcm, &dma) : 0;
+  std::vector<DMAChannel::BeaconStep> beacon;
+  std::vector<DMAChannel::Output> outputs;
+  // messages and beacons are looked up in the program cache by their text and frequencies
+  ProgramCache * cache = cacheDirectory && !outputsMode && !glyphMode ? new ProgramCache(cacheDirectory) : 0;
+  std::string description = beaconMode ? "beacon" : "message";
+  for (int argument = beaconMode ? optind : optind + 2; argument < argc; argument++) {
+    description = description + "\n" + argv[argument];
   }
+  if (outputsMode) {
+    // every output is keyed by the one program - the others run from GP1/GP2 dividers of the same PLLC
+    for (int argument = optind + 1; argument < argc; argument += 3) {
+      DMAChannel::Output output;
+      output.gpio = argument == optind + 1 ? &gpio : new GPIO(atoi(argv[argument]), &peripheralUtil);
+      if (output.gpio != &gpio) clock.startOutput(output.gpio, atoi(argv[argument + 1]));
+      const char * outputMessage = argv[argument + 2];
+      size_t outputSize = strlen(outputMessage) * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+      output.subSymbols = reinterpret_cast<char *>(malloc(outputSize));
+      output.subSymbolsSize = MorseEncoder::messageToMorse(outputMessage, output.subSymbols, outputSize);
+      outputs.push_back(output);
+    }
+    dma.loadOutputs(outputs, clocksPerSubSymbol);
+  } else if (cache && dma.loadCachedProgram(cache, description.c_str(), clocksPerSubSymbol)) {
+    LOG_INFO("Sending the program from the cache\n");
+  } else if (beaconMode) {
+    // each step retunes (with DMA writes of the clock registers) and then sends its message
+    LOG_INFO("Frequency plan:\n");
+    for (int argument = optind; argument < argc; argument += argument == optind ? 3 : 2) {
+      const char * stepMessage = argv[argument + (argument == optind ? 2 : 1)];
+      Clock::FrequencyPlan plan = Clock::planFrequency(atoi(argv[argument]));
+      Clock::reportPlan(plan);
+      DMAChannel::BeaconStep step;
+      step.retune = clock.retuneSequence(plan);
+      size_t stepSize = strlen(stepMessage) * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+      step.subSymbols = reinterpret_cast<char *>(malloc(stepSize));
+      step.subSymbolsSize = MorseEncoder::messageToMorse(stepMessage, step.subSymbols, stepSize);
+      beacon.push_back(step);
+    }
+    dma.loadBeacon(beacon, clocksPerSubSymbol);
+    if (cache) dma.cacheProgram(cache, description.c_str(), clocksPerSubSymbol);
+  } else if (glyphMode) {
+    if (!MorseEncoder::isEncodable(message)) {
+      LOG_ERROR("Error during encoding - character not found in translation table\n");
+      exit(-1);
+    }
+    dma.loadGlyphMessage(message, clocksPerSubSymbol);
+  } else {
+    messageLen = MorseEncoder::messageToMorse(message, transmissionBuffer, messageLen);
+    dma.loadMessage(transmissionBuffer, messageLen, clocksPerSubSymbol, message);
+    if (cache) dma.cacheProgram(cache, description.c_str(), clocksPerSubSymbol);
+  }
+  if (loopGap >= 0.0) {
+    dma.loopProgram(loopGap * pcm.getTickRate());
+  }
+  bool admitted = true;
+  if (slot >= 0.0) {
+    CBVerifier::Result check = dma.verifyProgram();
+    double seconds = check.ticks / pcm.getTickRate();
+    admitted = check.valid && (check.terminated || check.loops) && (slot == 0.0 || seconds <= slot);
+    if (!admitted) {
+      LOG_ERROR("Program not sent: %s\n", check.valid ? "it doesn't fit in the slot" : "it is not valid");
+      exitLoop = true;
+    }
+  }
+  if (admitted) {
+    abortChannel = &dma;
+    dma.dmaStart();
+    fprintf(stdout, "Message transmission started.\n");
+  }
+  if (loopGap >= 0.0 && admitted) {
+    // the DMA engine repeats the program by itself - only wake to publish progress and, now and then, report
+    fprintf(stdout, "Repeating until interrupted, the cycle being sent is then finished\n");
+    finishCycle = true;
+    for (int wake = 1; !exitLoop; wake++) {
+      if (statsPage) {
+        usleep(100000);
+        dma.progress();
+      } else {
+        sleep(10);
+      }
+      if (wake % (statsPage ? 600 : 6) == 0) {
+        fprintf(stdout, "%llu cycles sent\n", static_cast<unsigned long long>(dma.getLoopCycles()));
+      }
+    }
+    dma.stopLoop();
+    finishCycle = false;
+    exitLoop = false;  // a second interrupt abandons the last cycle
+  }
+  if (admitted) {
+    fprintf(stdout, "Expected transmission time %.3f seconds\n", dma.getPredictedDuration());
+  }
+  double const MAXIMUM_TRANSMISSION_TIME = 600.0;  // 10 minutes
+  double const WAIT_SLICE = 0.1;  // seconds between progress updates and checks of the termination request
+  bool complete = false;
+  int slice = 0;
+  for (double waited = 0.0; !complete && !exitLoop && waited < MAXIMUM_TRANSMISSION_TIME; waited += WAIT_SLICE) {
+    complete = dma.waitForCompletion(WAIT_SLICE);
+    Progress progress = dma.progress();
+    if (!complete && slice++ % 10 == 0) {
+      if (progress.characters) {
+        fprintf(stdout, "Sending character %d of %d (%.1f%%), %.1f seconds remaining\n", progress.character + 1,
+                progress.characters, progress.percent, progress.remaining);
+      } else {
+        fprintf(stdout, "Sending, %.1f seconds remaining\n", progress.remaining);
+      }
+    }
+  }
+  abortChannel = 0;
+  if (complete) {
+    fprintf(stdout, "Message transmission complete, detected %.3f ms after the predicted end (poll interval %.3f ms)\n",
+            dma.getCompletionError() * 1000.0, dma.getCompletionLatency() * 1000.0);
+  }
+  delete health;
+  delete cache;
   free(transmissionBuffer);
-  return 0;
+  for (DMAChannel::BeaconStep & step : beacon) {
+    free(step.subSymbols);
+  }
+  for (DMAChannel::Output & output : outputs) {
+    free(output.subSymbols);
+    if (output.gpio != &gpio) delete output.gpio;
+  }
+  delete statsPage;
+  return admitted ? 0 : -1;
 }
@@ -0,0 +1,189 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Benchmark of message encoding, control block compilation and memory footprint - runs on the emulator
+
+Mark Broihier 2021
+*/
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../include/DMAChannel.h"
+#include "../include/Emulator.h"
+#include "../include/GPIO.h"
+#include "../include/Logger.h"
+#include "../include/MorseEncoder.h"
+#include "../include/PCMHW.h"
+#include "../include/Peripheral.h"
+
+static const char * TEXT = "CQ CQ CQ DE KG5YJE KG5YJE K 73 ";
+static const double MINIMUM_SAMPLE_TIME = 0.05;  // seconds - short runs are repeated until they take this long
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static long peakRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // kB
+}
+
+// the compile logs its program size each time - send what the timed loops log to /dev/null (the ring may fill
+// and drop some of it)
+static int savedStderr = -1;
+
+static void quiet(bool on) {
+  Logger::flush();
+  if (on) {
+    savedStderr = dup(STDERR_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+  } else if (savedStderr >= 0) {
+    dup2(savedStderr, STDERR_FILENO);
+    close(savedStderr);
+    savedStderr = -1;
+  }
+}
+
+typedef struct Result {
+  const char * mode;
+  unsigned threads;
+  size_t length;
+  uint32_t rate;
+  double charactersPerSecond;
+  double cbsPerSecond;
+  double compileMs;
+  uint32_t cbCount;
+  size_t dmaBytes;
+  long peakRSS;
+} Result;
+
+static void printResult(const Result & result, bool json, bool first) {
+  if (json) {
+    fprintf(stdout, "%s  {\"mode\": \"%s\", \"threads\": %u, \"length\": %zu, \"wpm\": %u, "
+            "\"encode_chars_per_s\": %.0f, \"compile_cbs_per_s\": %.0f, \"compile_ms\": %.3f, \"cb_count\": %u, "
+            "\"dma_bytes\": %zu, \"peak_rss_kb\": %ld}", first ? "" : ",\n", result.mode, result.threads,
+            result.length, result.rate,
+            result.charactersPerSecond, result.cbsPerSecond, result.compileMs, result.cbCount, result.dmaBytes,
+            result.peakRSS);
+  } else {
+    fprintf(stdout, "%s,%u,%zu,%u,%.0f,%.0f,%.3f,%u,%zu,%ld\n", result.mode, result.threads, result.length, result.rate,
+            result.charactersPerSecond, result.cbsPerSecond, result.compileMs, result.cbCount, result.dmaBytes,
+            result.peakRSS);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+  bool json = false;
+  size_t maximumLength = 1000000;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  int opt;
+  while ((opt = getopt(argc, argv, "jt:")) != -1) {
+    if (opt == 'j') json = true;
+    if (opt == 't') threads = std::max(1, atoi(optarg));
+  }
+  if (argc - optind > 1) {
+    fprintf(stdout, "Usage: ./morse_bench [-j] [-t <compile threads>] [maximum message length - default is 1000000]\n"
+            "       CSV (or JSON with -j) results go to stdout, progress messages to stderr\n"
+            "       rle_parallel compiles on <compile threads> threads (default is one per core)\n");
+    exit(-1);
+  }
+  if (argc - optind == 1) maximumLength = atoi(argv[optind]);
+
+  // the largest mailbox memory the 30 bit bus addresses leave room for, touched only where it is used
+  Peripheral peripheralUtil(new Emulator(false, 896 << 20));
+  GPIO gpio(4, &peripheralUtil);
+
+  const uint32_t rates[] = { 5, 10, 20, 40, 60 };
+  const char * modes[] = { "rle", "rle_parallel", "glyph" };
+  size_t textLength = strlen(TEXT);
+  if (json) {
+    fprintf(stdout, "[\n");
+  } else {
+    fprintf(stdout, "mode,threads,length,wpm,encode_chars_per_s,compile_cbs_per_s,compile_ms,cb_count,dma_bytes,"
+            "peak_rss_kb\n");
+  }
+  bool first = true;
+  for (size_t length = 10; length <= maximumLength; length *= 10) {
+    char * message = reinterpret_cast<char *>(malloc(length + 1));
+    for (size_t index = 0; index < length; index++) {
+      message[index] = TEXT[index % textLength];
+    }
+    message[length] = 0;
+    size_t maximumSubSymbols = length * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER;
+    char * subSymbols = reinterpret_cast<char *>(malloc(maximumSubSymbols));
+
+    // encoding does not depend on the rate
+    size_t subSymbolsSize = 0;
+    int repetitions = 0;
+    double start = now();
+    do {
+      subSymbolsSize = MorseEncoder::encode(message, length, subSymbols, maximumSubSymbols);
+      repetitions++;
+    } while (now() - start < MINIMUM_SAMPLE_TIME);
+    double charactersPerSecond = length * repetitions / (now() - start);
+
+    for (const char * mode : modes) {
+      bool glyphMode = strcmp(mode, "glyph") == 0;
+      DMAChannel dma(5, &gpio, &peripheralUtil);  // a channel per mode so dma_bytes is that mode's footprint
+      unsigned modeThreads = strcmp(mode, "rle_parallel") == 0 ? threads : 1;
+      dma.setCompileThreads(modeThreads);
+      for (uint32_t rate : rates) {
+        uint32_t clocksPerSubSymbol = PCMHW::clocksPerSubSymbol(rate);
+        repetitions = 0;
+        quiet(true);
+        start = now();
+        do {
+          if (glyphMode) {
+            dma.loadGlyphMessage(message, clocksPerSubSymbol);
+          } else {
+            dma.loadMessage(subSymbols, subSymbolsSize, clocksPerSubSymbol);
+          }
+          repetitions++;
+        } while (now() - start < MINIMUM_SAMPLE_TIME);
+        double compileTime = (now() - start) / repetitions;
+        quiet(false);
+        Result result = { mode, modeThreads, length, rate, charactersPerSecond, dma.getCBCount() / compileTime,
+                          compileTime * 1000.0, dma.getCBCount(), dma.getDMABytes(), peakRSS() };
+        printResult(result, json, first);
+        first = false;
+      }
+    }
+    free(subSymbols);
+    free(message);
+  }
+  if (json) fprintf(stdout, "\n]\n");
+  return 0;
+}
@@ -0,0 +1,65 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Reader of the transmission progress that morse -p publishes in shared memory
+
+Mark Broihier 2021
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../include/StatsPage.h"
+
+// a single read, or one every interval seconds until the transmission ends
+int main(int argc, char ** argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stdout, "Usage: ./morse_stats <name> [seconds between reads - default is a single read]\n"
+            "       reads the page /dev/shm/<name> that ./morse -p <name> publishes\n");
+    exit(-1);
+  }
+  double interval = argc == 3 ? atof(argv[2]) : 0.0;
+  StatsPage page(argv[1], false);
+  bool seenRunning = false;
+  while (true) {
+    Progress progress;
+    if (!page.read(&progress)) {
+      fprintf(stderr, "No consistent copy of the progress could be read\n");
+      exit(-1);
+    }
+    uint32_t character = progress.character < progress.characters ? progress.character + 1 : progress.characters;
+    fprintf(stdout, "%s: character %d of %d (%.1f%%), %.1f seconds sent, %.1f seconds remaining\n",
+            progress.running ? "running" : "idle", character, progress.characters, progress.percent,
+            progress.elapsed, progress.remaining);
+    fflush(stdout);
+    seenRunning |= progress.running != 0;
+    if (interval <= 0.0 || (seenRunning && !progress.running)) break;
+    usleep(static_cast<useconds_t>(interval * 1e6));
+  }
+  return 0;
+}
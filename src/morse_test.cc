@@ -0,0 +1,322 @@
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+
+Emulator tests: each case sends a program the way morse does and compares the key edges and length the verifier
+works out from the control blocks with the key edges the emulator records
+
+Mark Broihier 2021
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../include/CBVerifier.h"
+#include "../include/Clock.h"
+#include "../include/DMAChannel.h"
+#include "../include/Emulator.h"
+#include "../include/GPIO.h"
+#include "../include/Logger.h"
+#include "../include/MorseEncoder.h"
+#include "../include/PCMHW.h"
+#include "../include/Peripheral.h"
+
+static const uint32_t FREQUENCY = 7040000;
+static const uint32_t PIN = 4;
+static const uint32_t SECOND_PIN = 5;  // GPCLK1
+static const double WAIT_TIMEOUT = 30.0;  // seconds
+
+typedef std::vector<CBVerifier::Edge> Edges;
+
+static bool failed = false;
+
+static void check(bool condition, const char * what) {
+  fprintf(stdout, "%s: %s\n", condition ? "ok  " : "FAIL", what);
+  if (!condition) failed = true;
+}
+
+static std::vector<char> encode(const char * message) {
+  std::vector<char> subSymbols(strlen(message) * MorseEncoder::MAXIMUM_SUBSYMBOLS_PER_CHARACTER);
+  subSymbols.resize(MorseEncoder::messageToMorse(message, subSymbols.data(), subSymbols.size()));
+  return subSymbols;
+}
+
+// the edges subsymbols key, starting at tick start - what a run compiled program of them should do
+// In real time the engine can wake late on a busy host, and an edge is then recorded that many PCM clocks late - up
+// to a quarter of a subsymbol, which still can't be taken for the edge before or after it
+static uint64_t lateness(uint32_t clocksPerSubSymbol) {
+  return clocksPerSubSymbol / 4;
+}
+
+static Edges subSymbolEdges(const std::vector<char> & subSymbols, uint32_t clocksPerSubSymbol, uint64_t start) {
+  Edges edges;
+  bool keyDown = false;
+  for (size_t index = 0; index < subSymbols.size(); index++) {
+    if ((subSymbols[index] != 0) == keyDown) continue;
+    keyDown = !keyDown;
+    CBVerifier::Edge edge = { PIN, keyDown, start + index * clocksPerSubSymbol };
+    edges.push_back(edge);
+  }
+  if (keyDown) {
+    CBVerifier::Edge edge = { PIN, false, start + subSymbols.size() * clocksPerSubSymbol };
+    edges.push_back(edge);
+  }
+  return edges;
+}
+
+// The emulator counts PCM clocks from its own start, so its edges are offset from the verifier's.  Each edge has to
+// be on the same pin, in the same direction and, after the offset, within tolerance PCM clocks.
+static bool sameEdges(const Edges & expected, const std::vector<Emulator::KeyEdge> & timeline, uint64_t offset,
+                      uint64_t tolerance, bool quiet = false) {
+  if (expected.size() != timeline.size()) {
+    if (!quiet) {
+      fprintf(stdout, "      %d edges expected, the emulator recorded %d\n", static_cast<int>(expected.size()),
+              static_cast<int>(timeline.size()));
+    }
+    return false;
+  }
+  for (size_t index = 0; index < expected.size(); index++) {
+    uint64_t tick = expected[index].tick + offset;
+    uint64_t distance = tick > timeline[index].tick ? tick - timeline[index].tick : timeline[index].tick - tick;
+    if (expected[index].pin != timeline[index].pin || expected[index].keyDown != timeline[index].keyDown ||
+        distance > tolerance) {
+      if (!quiet) {
+        fprintf(stdout, "      edge %d: expected pin %d %s at %llu, the emulator has pin %d %s at %llu\n",
+                static_cast<int>(index), expected[index].pin, expected[index].keyDown ? "down" : "up",
+                static_cast<unsigned long long>(tick), timeline[index].pin, timeline[index].keyDown ? "down" : "up",
+                static_cast<unsigned long long>(timeline[index].tick));
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// In real time the emulator's PCM clock count at the start isn't known, but edges are only ever late, so the
+// offset is the smallest difference
+static uint64_t earliestOffset(const Edges & expected, const std::vector<Emulator::KeyEdge> & timeline) {
+  uint64_t offset = UINT64_MAX;
+  for (size_t index = 0; index < expected.size() && index < timeline.size(); index++) {
+    offset = std::min(offset, timeline[index].tick - expected[index].tick);
+  }
+  return offset == UINT64_MAX ? 0 : offset;
+}
+
+// The FIFO fill control block writes one word more than the FIFO holds, so a run compiled program's first run
+// starts a PCM clock in.
+static bool sameAsEncoded(const Edges & edges, const std::vector<char> & subSymbols, uint32_t clocksPerSubSymbol) {
+  Edges encoded = subSymbolEdges(subSymbols, clocksPerSubSymbol, 1);
+  if (encoded.size() != edges.size()) return false;
+  for (size_t index = 0; index < encoded.size(); index++) {
+    if (encoded[index].tick != edges[index].tick || encoded[index].keyDown != edges[index].keyDown) return false;
+  }
+  return true;
+}
+
+// The transmitter as morse sets it up, on an emulator that runs in real time or, without real time, as fast as it
+// can - then PCM clocks only pass while the DMA engine is waiting for one, so the emulator's PCM clock count over a
+// program is the program's length exactly.
+class Rig {
+ public:
+  Emulator * emulator;
+  Peripheral peripheralUtil;
+  GPIO gpio;
+  Clock clock;
+  PCMHW pcm;
+  DMAChannel dma;
+  uint32_t clocksPerSubSymbol;
+
+  Rig(Emulator * emulator, uint32_t wordsPerMinute) :
+    emulator(emulator), peripheralUtil(emulator), gpio(PIN, &peripheralUtil),
+    clock(FREQUENCY, &gpio, &peripheralUtil), pcm(&clock, &peripheralUtil), dma(5, &gpio, &peripheralUtil) {
+    clocksPerSubSymbol = pcm.setPCMFrequency(wordsPerMinute);
+    dma.setTickRate(pcm.getTickRate());
+  }
+
+  // sends the loaded program, checked against the verifier's timeline of it
+  void send(const char * what) {
+    CBVerifier::Result expected = dma.verifyProgram();
+    check(expected.valid && expected.terminated, (std::string(what) + ": the verifier accepts the program").c_str());
+    uint64_t start = emulator->getTicks();
+    dma.dmaStart();
+    check(dma.waitForCompletion(WAIT_TIMEOUT), (std::string(what) + ": the program ends").c_str());
+    check(emulator->getTicks() - start == expected.ticks,
+          (std::string(what) + ": the emulator's PCM clocks match the verifier's length").c_str());
+    check(sameEdges(expected.edges, emulator->getTimeline(), start, 0),
+          (std::string(what) + ": the emulator's key edges match the verifier's").c_str());
+  }
+};
+
+static void runCompiled() {
+  Emulator * emulator = new Emulator(false);
+  emulator->watchPin(PIN);
+  Rig rig(emulator, 20);
+  const char * message = "CQ DE KG5YJE";
+  std::vector<char> subSymbols = encode(message);
+  rig.dma.loadMessage(subSymbols.data(), subSymbols.size(), rig.clocksPerSubSymbol, message);
+  check(sameAsEncoded(rig.dma.verifyProgram().edges, subSymbols, rig.clocksPerSubSymbol),
+        "run: the verifier's key edges are the encoded message's");
+  rig.send("run");
+}
+
+static void glyph() {
+  Emulator * emulator = new Emulator(false);
+  emulator->watchPin(PIN);
+  Rig rig(emulator, 20);
+  rig.dma.loadGlyphMessage("CQ DE KG5YJE", rig.clocksPerSubSymbol);
+  rig.send("glyph");
+}
+
+static void beacon() {
+  Emulator * emulator = new Emulator(false);
+  emulator->watchPin(PIN);
+  Rig rig(emulator, 20);
+  std::vector<DMAChannel::BeaconStep> steps;
+  const struct {
+    uint32_t frequency;
+    const char * message;
+  } plan[] = { { FREQUENCY, "VVV DE KG5YJE" }, { 14050000, "VVV" } };
+  std::vector<std::vector<char>> subSymbols;
+  for (auto & step : plan) {
+    subSymbols.push_back(encode(step.message));
+  }
+  for (size_t index = 0; index < subSymbols.size(); index++) {
+    DMAChannel::BeaconStep step;
+    step.retune = rig.clock.retuneSequence(Clock::planFrequency(plan[index].frequency));
+    step.subSymbols = subSymbols[index].data();
+    step.subSymbolsSize = subSymbols[index].size();
+    steps.push_back(step);
+  }
+  rig.dma.loadBeacon(steps, rig.clocksPerSubSymbol);
+  rig.send("beacon");
+}
+
+static void outputs() {
+  Emulator * emulator = new Emulator(false);
+  emulator->watchPin(PIN);
+  emulator->watchPin(SECOND_PIN);
+  Rig rig(emulator, 20);
+  GPIO second(SECOND_PIN, &rig.peripheralUtil);
+  rig.clock.startOutput(&second, 10120000);
+  std::vector<char> first = encode("CQ");
+  std::vector<char> other = encode("TEST DE KG5YJE");
+  std::vector<DMAChannel::Output> outputs(2);
+  outputs[0].gpio = &rig.gpio;
+  outputs[0].subSymbols = first.data();
+  outputs[0].subSymbolsSize = first.size();
+  outputs[1].gpio = &second;
+  outputs[1].subSymbols = other.data();
+  outputs[1].subSymbolsSize = other.size();
+  rig.dma.loadOutputs(outputs, rig.clocksPerSubSymbol);
+  rig.send("outputs");
+}
+
+// Two messages queued back to back: the second is linked while the first is being sent, and the verifier follows
+// the link, so its timeline is of both.
+static void queue() {
+  Emulator * emulator = new Emulator(true);
+  emulator->watchPin(PIN);
+  Rig rig(emulator, 20);
+  std::vector<char> first = encode("PARIS ");
+  std::vector<char> second = encode("E T ");
+  check(rig.dma.queueMessage(first.data(), first.size(), rig.clocksPerSubSymbol) < 0.0,
+        "queue: the first message starts the channel");
+  check(rig.dma.queueMessage(second.data(), second.size(), rig.clocksPerSubSymbol) >= 0.0,
+        "queue: the second message is linked to the first");
+  CBVerifier::Result expected = rig.dma.verifyProgram();
+  check(expected.valid && expected.terminated &&
+        expected.ticks == (first.size() + second.size()) * rig.clocksPerSubSymbol + 1,
+        "queue: the verifier follows the link to the end of the second message");
+  check(rig.dma.waitForCompletion(WAIT_TIMEOUT), "queue: the messages end");
+  std::vector<Emulator::KeyEdge> timeline = emulator->getTimeline();
+  check(sameEdges(expected.edges, timeline, earliestOffset(expected.edges, timeline),
+                  lateness(rig.clocksPerSubSymbol)),
+        "queue: the emulator's key edges match the verifier's");
+}
+
+// A priority message spliced into a playing one is taken back out of the chain once the engine is in it, so the
+// verifier can only check the message.  The timeline has to be the message's with the priority message's subsymbols
+// put in at one of the message's run boundaries.
+static void priority() {
+  Emulator * emulator = new Emulator(true);
+  emulator->watchPin(PIN);
+  Rig rig(emulator, 20);
+  const char * message = "PARIS PARIS";
+  std::vector<char> subSymbols = encode(message);
+  std::vector<char> urgent = encode("SOS ");
+  rig.dma.loadMessage(subSymbols.data(), subSymbols.size(), rig.clocksPerSubSymbol, message);
+  CBVerifier::Result expected = rig.dma.verifyProgram();
+  check(sameAsEncoded(expected.edges, subSymbols, rig.clocksPerSubSymbol),
+        "priority: the verifier's key edges are the encoded message's");
+  rig.dma.dmaStart();
+  usleep(500000);
+  check(rig.dma.sendPriority(urgent.data(), urgent.size(), rig.clocksPerSubSymbol) >= 0.0,
+        "priority: the priority message is spliced in");
+  check(llround(rig.dma.getPredictedDuration() * rig.pcm.getTickRate()) ==
+        static_cast<long long>(expected.ticks + urgent.size() * rig.clocksPerSubSymbol),
+        "priority: the predicted length grows by the priority message");
+  check(rig.dma.waitForCompletion(WAIT_TIMEOUT), "priority: the messages end");
+  std::vector<Emulator::KeyEdge> timeline = emulator->getTimeline();
+  bool matched = false;
+  for (size_t boundary = 1; !matched && boundary < subSymbols.size(); boundary++) {
+    if (subSymbols[boundary] == subSymbols[boundary - 1]) continue;
+    std::vector<char> spliced(subSymbols.begin(), subSymbols.begin() + boundary);
+    spliced.insert(spliced.end(), urgent.begin(), urgent.end());
+    spliced.insert(spliced.end(), subSymbols.begin() + boundary, subSymbols.end());
+    Edges edges = subSymbolEdges(spliced, rig.clocksPerSubSymbol, 1);
+    matched = sameEdges(edges, timeline, earliestOffset(edges, timeline), lateness(rig.clocksPerSubSymbol), true);
+  }
+  check(matched, "priority: the emulator's key edges are the message's with the priority message at a run boundary");
+}
+
+int main(int argc, char ** argv) {
+  const struct {
+    const char * name;
+    void (*run)();
+  } cases[] = {
+    { "run", runCompiled }, { "glyph", glyph }, { "beacon", beacon }, { "outputs", outputs }, { "queue", queue },
+    { "priority", priority }
+  };
+  if (argc != 2) {
+    fprintf(stdout, "Usage: ./morse_test <run | glyph | beacon | outputs | queue | priority>\n");
+    exit(-1);
+  }
+  for (auto & testCase : cases) {
+    if (strcmp(argv[1], testCase.name) == 0) {
+      testCase.run();
+      Logger::flush();
+      return failed ? 1 : 0;
+    }
+  }
+  fprintf(stdout, "No test case %s\n", argv[1]);
+  return -1;
+}